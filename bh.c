@@ -5,17 +5,54 @@
  * Copyright (c) 2017-2020, Silicon Laboratories, Inc.
  * Copyright (c) 2010, ST-Ericsson
  */
+#include <linux/module.h>
+#include <linux/version.h>
 #include <linux/gpio/consumer.h>
+#include <linux/sched.h>
+#if (KERNEL_VERSION(4, 11, 0) <= LINUX_VERSION_CODE)
+#include <uapi/linux/sched/types.h>
+#endif
 #include <net/mac80211.h>
 
 #include "bh.h"
 #include "wfx.h"
 #include "hwio.h"
+#include "bus.h"
+#include "data_tx.h"
 #include "traces.h"
 #include "secure_link.h"
 #include "hif_rx.h"
 #include "hif_api_cmd.h"
 
+#if (KERNEL_VERSION(4, 9, 0) > LINUX_VERSION_CODE)
+#define kthread_init_work(work, fn)      init_kthread_work(work, fn)
+#define kthread_queue_work(worker, work) queue_kthread_work(worker, work)
+#define kthread_flush_work(work)         flush_kthread_work(work)
+#endif
+
+static unsigned int poll_window_us;
+module_param(poll_window_us, uint, 0644);
+MODULE_PARM_DESC(poll_window_us, "after a busy bh run, poll the chip during this time before enabling the IRQ again. 0 disables polling (default: 0).");
+
+// Minimum number of messages processed in a run before to switch to polling
+#define BH_POLL_MIN_MSG 8
+
+static bool bh_in_irq;
+module_param(bh_in_irq, bool, 0644);
+MODULE_PARM_DESC(bh_in_irq, "receive the messages from the threaded IRQ handler instead of waking up bh (default: false).");
+
+static bool bh_thread;
+module_param(bh_thread, bool, 0444);
+MODULE_PARM_DESC(bh_thread, "run bh in a dedicated thread instead of the system high priority workqueue (default: false).");
+
+static unsigned int bh_rt_prio;
+module_param(bh_rt_prio, uint, 0444);
+MODULE_PARM_DESC(bh_rt_prio, "with bh_thread, use SCHED_FIFO with this priority (1-99). 0 means SCHED_NORMAL. Since Linux 5.9, the value is ignored and any non-zero value selects the default SCHED_FIFO priority (default: 0).");
+
+static char *bh_cpus = "";
+module_param(bh_cpus, charp, 0444);
+MODULE_PARM_DESC(bh_cpus, "with bh_thread, list of CPUs allowed to run bh (eg. \"2-3\"). Empty means all CPUs (default: \"\").");
+
 static void device_wakeup(struct wfx_dev *wdev)
 {
 	int max_retry = 3;
@@ -63,6 +100,56 @@ static void device_release(struct wfx_dev *wdev)
 	gpiod_set_value_cansleep(wdev->pdata.gpio_wakeup, 0);
 }
 
+/*
+ * Most of the received messages are confirmations and indications released as
+ * soon as they are processed. Keep their buffers for the next reads instead of
+ * returning them to the allocator. Only the frames passed to mac80211 leave
+ * the pool.
+ */
+#define WFX_RX_POOL_SIZE 16
+
+static size_t bh_rx_pool_buf_len(struct wfx_dev *wdev)
+{
+	return wdev->hwbus_ops->align_size(wdev->hwbus_priv,
+					   wdev->hw_caps.size_inp_ch_buf + 2);
+}
+
+static struct sk_buff *bh_rx_alloc(struct wfx_dev *wdev, size_t len)
+{
+	size_t pool_len = bh_rx_pool_buf_len(wdev);
+	struct sk_buff *skb;
+
+	if (len <= pool_len) {
+		skb = __skb_dequeue(&wdev->hif.rx_pool);
+		if (skb && skb_tailroom(skb) >= len) {
+			wdev->hif.rx_pool_hits++;
+			return skb;
+		}
+		dev_kfree_skb(skb);
+		len = pool_len;
+	}
+	wdev->hif.rx_pool_misses++;
+	return dev_alloc_skb(len);
+}
+
+void wfx_bh_rx_recycle(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	if (!wdev->hw_caps.size_inp_ch_buf ||
+	    skb_queue_len(&wdev->hif.rx_pool) >= WFX_RX_POOL_SIZE ||
+	    skb_shared(skb) || skb_cloned(skb) || skb_is_nonlinear(skb) ||
+	    skb_end_offset(skb) < NET_SKB_PAD + bh_rx_pool_buf_len(wdev)) {
+		dev_kfree_skb(skb);
+		return;
+	}
+	skb->data = skb->head;
+	skb_reset_tail_pointer(skb);
+	skb->len = 0;
+	skb_reserve(skb, NET_SKB_PAD);
+	// Last released buffer is probably still in cache
+	__skb_queue_head(&wdev->hif.rx_pool, skb);
+	wdev->hif.rx_pool_recycled++;
+}
+
 static int rx_helper(struct wfx_dev *wdev, size_t read_len, int *is_cnf)
 {
 	struct sk_buff *skb;
@@ -77,7 +164,7 @@ static int rx_helper(struct wfx_dev *wdev, size_t read_len, int *is_cnf)
 
 	// Add 2 to take into account piggyback size
 	alloc_len = wdev->hwbus_ops->align_size(wdev->hwbus_priv, read_len + 2);
-	skb = dev_alloc_skb(alloc_len);
+	skb = bh_rx_alloc(wdev, alloc_len);
 	if (!skb)
 		return -ENOMEM;
 
@@ -112,7 +199,7 @@ static int rx_helper(struct wfx_dev *wdev, size_t read_len, int *is_cnf)
 	}
 	if (hif->encrypted == 0x2) {
 		if (wfx_sl_decode(wdev, (struct hif_sl_msg *)hif)) {
-			dev_kfree_skb(skb);
+			wfx_bh_rx_recycle(wdev, skb);
 			// If frame was a confirmation, expect trouble in next
 			// exchange. However, it is harmless to fail to decode
 			// an indication frame, so try to continue. Anyway,
@@ -124,7 +211,7 @@ static int rx_helper(struct wfx_dev *wdev, size_t read_len, int *is_cnf)
 	} else if (wfx_is_secure_command(wdev, hif->id) &&
 		   !wfx_api_older_than(wdev, 3, 4)) {
 		dev_warn(wdev->dev, "drop expected encrypted command\n");
-		dev_kfree_skb(skb);
+		wfx_bh_rx_recycle(wdev, skb);
 		return piggyback;
 	}
 #else
@@ -171,10 +258,55 @@ static int rx_helper(struct wfx_dev *wdev, size_t read_len, int *is_cnf)
 
 err:
 	if (skb)
-		dev_kfree_skb(skb);
+		wfx_bh_rx_recycle(wdev, skb);
 	return -EIO;
 }
 
+/*
+ * Frames are delivered to mac80211 from a NAPI context. So they are passed in
+ * batches to the network stack and GRO can merge them.
+ */
+void wfx_bh_queue_rx(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	skb_queue_tail(&wdev->hif.rx_napi_queue, skb);
+}
+
+static int bh_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct wfx_dev *wdev = container_of(napi, struct wfx_dev, hif.napi);
+	struct sk_buff *skb;
+	int done = 0;
+
+	while (done < budget) {
+		skb = skb_dequeue(&wdev->hif.rx_napi_queue);
+		if (!skb)
+			break;
+#if (KERNEL_VERSION(4, 5, 0) > LINUX_VERSION_CODE)
+		ieee80211_rx(wdev->hw, skb);
+#else
+		ieee80211_rx_napi(wdev->hw, NULL, skb, napi);
+#endif
+		done++;
+	}
+	if (done < budget) {
+		napi_complete_done(napi, done);
+		// A frame may have been queued before napi_complete_done()
+		if (!skb_queue_empty(&wdev->hif.rx_napi_queue))
+			napi_schedule(napi);
+	}
+	return done;
+}
+
+static void bh_napi_schedule(struct wfx_dev *wdev)
+{
+	if (skb_queue_empty(&wdev->hif.rx_napi_queue))
+		return;
+	// napi_schedule() expects to be called with softirqs disabled
+	local_bh_disable();
+	napi_schedule(&wdev->hif.napi);
+	local_bh_enable();
+}
+
 static int bh_work_rx(struct wfx_dev *wdev, int max_msg, int *num_cnf)
 {
 	size_t len;
@@ -210,120 +342,379 @@ static int bh_work_rx(struct wfx_dev *wdev, int max_msg, int *num_cnf)
 	return i;
 }
 
-static void tx_helper(struct wfx_dev *wdev, struct hif_msg *hif)
+static unsigned int tx_batch = WFX_BUS_MAX_BATCH;
+module_param(tx_batch, uint, 0644);
+MODULE_PARM_DESC(tx_batch, "maximum number of messages sent in one bus transfer (default: 16, 1 disables batching).");
+
+/*
+ * Return the buffer to send to the device. If it is not hif, it is a slot of
+ * the secure link ring that has to be released once sent.
+ */
+static void *tx_helper(struct wfx_dev *wdev, struct hif_msg *hif, size_t *len)
 {
-	int ret;
 	void *data;
-	bool is_encrypted = false;
-	size_t len = le16_to_cpu(hif->len);
+	size_t data_len = le16_to_cpu(hif->len);
 
-	WARN(len < sizeof(*hif), "try to send corrupted data");
+	WARN(data_len < sizeof(*hif), "try to send corrupted data");
 
 	hif->seqnum = wdev->hif.tx_seqnum;
 	wdev->hif.tx_seqnum = (wdev->hif.tx_seqnum + 1) % (HIF_COUNTER_MAX + 1);
 
-#ifdef CONFIG_WFX_SECURE_LINK
 	if (wfx_is_secure_command(wdev, hif->id)) {
-		len = round_up(len - sizeof(hif->len), 16) + sizeof(hif->len) +
-			sizeof(struct hif_sl_msg_hdr) +
+		data_len = round_up(data_len - sizeof(hif->len), 16) +
+			sizeof(hif->len) + sizeof(struct hif_sl_msg_hdr) +
 			sizeof(struct hif_sl_tag);
 		// AES support encryption in-place. However, mac80211 access to
 		// 802.11 header after frame was sent (to get MAC addresses).
 		// So, keep origin buffer clear.
-		data = kmalloc(len, GFP_KERNEL);
-		if (!data)
-			goto end;
-		is_encrypted = true;
-		ret = wfx_sl_encode(wdev, hif, data);
-		if (ret)
-			goto end;
+		data = wfx_sl_encode(wdev, hif);
+		if (PTR_ERR_OR_ZERO(data) == -EBUSY && wdev->hwbus_ops->flush) {
+			// All the slots are used by asynchronous transfers
+			wdev->hwbus_ops->flush(wdev->hwbus_priv);
+			data = wfx_sl_encode(wdev, hif);
+		}
+		if (IS_ERR(data))
+			return NULL;
 	} else {
 		data = hif;
 	}
-#else
-	data = hif;
-#endif
-	WARN(len > wdev->hw_caps.size_inp_ch_buf,
+	WARN(data_len > wdev->hw_caps.size_inp_ch_buf,
 	     "%s: request exceed WFx capability: %zu > %d\n", __func__,
-	     len, wdev->hw_caps.size_inp_ch_buf);
-	len = wdev->hwbus_ops->align_size(wdev->hwbus_priv, len);
-	ret = wfx_data_write(wdev, data, len);
-	if (ret)
-		goto end;
+	     data_len, wdev->hw_caps.size_inp_ch_buf);
+	*len = wdev->hwbus_ops->align_size(wdev->hwbus_priv, data_len);
+	return data;
+}
 
-	wdev->hif.tx_buffers_used++;
-	_trace_hif_send(hif, wdev->hif.tx_buffers_used);
-end:
-	if (is_encrypted)
-		kfree(data);
+static struct hif_msg *bh_get_tx(struct wfx_dev *wdev)
+{
+	if (try_wait_for_completion(&wdev->hif_cmd.ready)) {
+		WARN(!mutex_is_locked(&wdev->hif_cmd.lock), "data locking error");
+		return wdev->hif_cmd.buf_send;
+	}
+	return wfx_tx_queues_get(wdev);
 }
 
-static int bh_work_tx(struct wfx_dev *wdev, int max_msg)
+#define BH_TX_COOKIE_CMD	BIT(16)
+// Bits of wfx_hif->tx_async_err
+#define BH_TX_ERR		0
+#define BH_TX_ERR_CMD		1
+
+/*
+ * cookie is the number of secure link slots used by the transfer. Bit
+ * BH_TX_COOKIE_CMD is set if the transfer carried the pending command.
+ *
+ * This function may be called in atomic context. On failure, it only records
+ * the error. bh handles it (see bh_tx_check_async_error()).
+ */
+void wfx_bh_tx_done(struct wfx_dev *wdev, void *cookie, int status)
 {
-	struct hif_msg *hif;
-	int i;
+	unsigned long val = (unsigned long)cookie;
+
+	if (status) {
+		dev_err(wdev->dev, "asynchronous bus transfer failed: %d\n",
+			status);
+		if (val & BH_TX_COOKIE_CMD)
+			set_bit(BH_TX_ERR_CMD, &wdev->hif.tx_async_err);
+		// Pairs with test_and_clear_bit() in bh_tx_check_async_error()
+		smp_mb__before_atomic();
+		set_bit(BH_TX_ERR, &wdev->hif.tx_async_err);
+		wfx_bh_request_tx(wdev);
+	}
+	wfx_sl_tx_release(wdev, val & ~BH_TX_COOKIE_CMD);
+}
 
-	for (i = 0; i < max_msg; i++) {
-		hif = NULL;
-		if (wdev->hif.tx_buffers_used < wdev->hw_caps.num_inp_ch_bufs) {
-			if (try_wait_for_completion(&wdev->hif_cmd.ready)) {
-				WARN(!mutex_is_locked(&wdev->hif_cmd.lock), "data locking error");
-				hif = wdev->hif_cmd.buf_send;
-			} else {
-				hif = wfx_tx_queues_get(wdev);
-			}
+/*
+ * After a failed asynchronous transfer, it is not possible to know which
+ * messages reached the chip. So, the buffer counter cannot be trusted anymore.
+ * Consider the chip as frozen and, if the transfer carried the pending
+ * command, do not let it wait for its full timeout. Must be called under
+ * bh_lock.
+ */
+static void bh_tx_check_async_error(struct wfx_dev *wdev)
+{
+	if (!test_and_clear_bit(BH_TX_ERR, &wdev->hif.tx_async_err))
+		return;
+	wdev->chip_frozen = true;
+	if (test_and_clear_bit(BH_TX_ERR_CMD, &wdev->hif.tx_async_err)) {
+		wdev->hif_cmd.ret = -EIO;
+		complete(&wdev->hif_cmd.done);
+	}
+}
+
+/*
+ * If the bus supports it, do not wait for the end of the transfer. So, the
+ * next messages can be prepared while the bus is busy.
+ *
+ * Return the number of messages written or a negative error.
+ */
+static int bh_tx_write(struct wfx_dev *wdev, struct hif_msg **hif,
+		       void **data, size_t *len, int num)
+{
+	unsigned long num_sl = 0;
+	unsigned long cookie;
+	int i, ret;
+
+	for (i = 0; i < num; i++)
+		if (data[i] != hif[i])
+			num_sl++;
+	if (wdev->hwbus_ops->copy_to_io_async) {
+		cookie = num_sl;
+		for (i = 0; i < num; i++)
+			if (hif[i] == wdev->hif_cmd.buf_send)
+				cookie |= BH_TX_COOKIE_CMD;
+		ret = wfx_data_write_async(wdev, data, len, num,
+					   (void *)cookie);
+		// Else, slots will be released by wfx_bh_tx_done()
+		if (!ret)
+			return num;
+		// Slots are released in order, so previous transfers have to
+		// be done first
+		wdev->hwbus_ops->flush(wdev->hwbus_priv);
+	} else {
+		ret = wfx_data_write_multi(wdev, data, len, num);
+	}
+	wfx_sl_tx_release(wdev, num_sl);
+	return ret;
+}
+
+/*
+ * Pack as many messages as the device can accept in one bus transfer. This
+ * saves the setup cost of the bus transactions.
+ */
+static int bh_work_tx(struct wfx_dev *wdev, int max_msg, int *max_batch)
+{
+	struct hif_msg *hif[WFX_BUS_MAX_BATCH];
+	void *data[WFX_BUS_MAX_BATCH];
+	size_t len[WFX_BUS_MAX_BATCH];
+	int batch_len = clamp_t(int, tx_batch, 1, WFX_BUS_MAX_BATCH);
+	int i, num, ret;
+	int count = 0;
+
+	while (count < max_msg) {
+		num = 0;
+		while (num < batch_len && count + num < max_msg &&
+		       wdev->hif.tx_buffers_used + num <
+		       wdev->hw_caps.num_inp_ch_bufs) {
+			hif[num] = bh_get_tx(wdev);
+			if (!hif[num])
+				break;
+			data[num] = tx_helper(wdev, hif[num], &len[num]);
+			// Message is lost, but count it to avoid an infinite loop
+			if (!data[num])
+				count++;
+			else
+				num++;
 		}
-		if (!hif)
-			return i;
-		tx_helper(wdev, hif);
+		if (!num)
+			break;
+		// The messages not written are lost. Only count the buffers
+		// actually used in chip.
+		ret = bh_tx_write(wdev, hif, data, len, num);
+		for (i = 0; i < ret; i++) {
+			wdev->hif.tx_buffers_used++;
+			_trace_hif_send(hif[i], wdev->hif.tx_buffers_used);
+		}
+		*max_batch = max(*max_batch, num);
+		count += num;
+		if (num < batch_len)
+			break;
 	}
-	return i;
+	return count;
 }
 
 /* In SDIO mode, it is necessary to make an access to a register to acknowledge
- * last received message. It could be possible to restrict this acknowledge to
- * SDIO mode and only if last operation was rx.
+ * last received message. The config register is read for that purpose.
+ *
+ * The control register and the piggyback do not report the errors of the chip.
+ * So, the errors are taken from the accesses to the config register that are
+ * done anyway (this acknowledge, the IRQ masking of bh_poll()). With SPI, the
+ * config register is no more read after each burst of received messages.
  */
 static void ack_sdio_data(struct wfx_dev *wdev)
 {
-	u32 cfg_reg;
+	u32 cfg_reg, errors;
+
+	if (wdev->hwbus_ops->rx_ack)
+		config_reg_read(wdev, &cfg_reg);
+	errors = config_reg_get_errors(wdev);
+	if (errors) {
+		dev_warn(wdev->dev, "chip reports errors: %02x\n", errors);
+		config_reg_write_bits(wdev, CFG_ERR_MASK, 0x00);
+	}
+}
+
+static bool bh_is_pending(struct wfx_dev *wdev)
+{
+	// kthread API does not provide any equivalent to work_pending()
+	if (rcu_access_pointer(wdev->hif.bh_worker))
+		return !list_empty(&wdev->hif.bh_kwork.node);
+	return work_pending(&wdev->hif.bh);
+}
+
+static void bh_poll_stop(struct wfx_dev *wdev)
+{
+	if (!wdev->hif.irq_masked)
+		return;
+	wdev->hif.irq_masked = false;
+	// IRQ is level triggered: it raises immediately if data is pending
+	config_reg_write_bits(wdev, CFG_IRQ_ENABLE_DATA, CFG_IRQ_ENABLE_DATA);
+}
 
-	config_reg_read(wdev, &cfg_reg);
-	if (cfg_reg & 0xFF) {
-		dev_warn(wdev->dev, "chip reports errors: %02x\n",
-			 cfg_reg & 0xFF);
-		config_reg_write_bits(wdev, 0xFF, 0x00);
+/*
+ * Under load, polling the control register is cheaper than an IRQ (IRQ
+ * handler, control register access and bh wake up). So, after a busy pass,
+ * keep polling the chip during poll_window_us before going back to IRQ mode.
+ *
+ * Chip loses the IRQs raised while the control register is read (see
+ * wfx_bh_poll_irq()). So, the data IRQ is disabled in the chip while polling.
+ *
+ * Return true if data is available.
+ */
+static bool bh_poll(struct wfx_dev *wdev, int num_msg)
+{
+	ktime_t end;
+	u32 reg;
+
+	if (!poll_window_us || wdev->poll_irq ||
+	    (!wdev->hif.irq_masked && num_msg < BH_POLL_MIN_MSG)) {
+		bh_poll_stop(wdev);
+		return false;
+	}
+	if (!wdev->hif.irq_masked) {
+		config_reg_write_bits(wdev, CFG_IRQ_ENABLE_DATA, 0);
+		wdev->hif.irq_masked = true;
 	}
+	end = ktime_add_us(ktime_get(), poll_window_us);
+	do {
+		// Let the next run handle the new request. It will also decide
+		// to continue polling or not.
+		if (bh_is_pending(wdev))
+			return false;
+		control_reg_read(wdev, &reg);
+		if (reg & CTRL_NEXT_LEN_MASK) {
+			// An IRQ may have been processed before masking
+			if (!atomic_cmpxchg(&wdev->hif.ctrl_reg, 0, reg))
+				complete(&wdev->hif.ctrl_ready);
+			return true;
+		}
+	} while (ktime_before(ktime_get(), end));
+	bh_poll_stop(wdev);
+	return false;
 }
 
-static void bh_work(struct work_struct *work)
+static void bh_schedule(struct wfx_dev *wdev)
 {
-	struct wfx_dev *wdev = container_of(work, struct wfx_dev, hif.bh);
-	int stats_req = 0, stats_cnf = 0, stats_ind = 0;
+	struct kthread_worker *worker;
+
+	// Protect against wfx_bh_unregister()
+	rcu_read_lock();
+	worker = rcu_dereference(wdev->hif.bh_worker);
+	if (worker)
+		kthread_queue_work(worker, &wdev->hif.bh_kwork);
+	else
+		queue_work(system_highpri_wq, &wdev->hif.bh);
+	rcu_read_unlock();
+}
+
+static void bh_run(struct wfx_dev *wdev)
+{
+	int stats_req = 0, stats_cnf = 0, stats_ind = 0, stats_batch = 0;
 	bool release_chip = false, last_op_is_rx = false;
 	int num_tx, num_rx;
+	int num_msg;
+	bool poll;
 
+	mutex_lock(&wdev->hif.bh_lock);
+	bh_tx_check_async_error(wdev);
 	device_wakeup(wdev);
 	do {
-		num_tx = bh_work_tx(wdev, 32);
-		stats_req += num_tx;
-		if (num_tx)
-			last_op_is_rx = false;
-		num_rx = bh_work_rx(wdev, 32, &stats_cnf);
-		stats_ind += num_rx;
-		if (num_rx)
-			last_op_is_rx = true;
-	} while (num_rx || num_tx);
+		num_msg = 0;
+		do {
+			num_tx = bh_work_tx(wdev, 32, &stats_batch);
+			stats_req += num_tx;
+			if (num_tx)
+				last_op_is_rx = false;
+			num_rx = bh_work_rx(wdev, 32, &stats_cnf);
+			stats_ind += num_rx;
+			if (num_rx) {
+				last_op_is_rx = true;
+				bh_napi_schedule(wdev);
+			}
+			num_msg += num_tx + num_rx;
+		} while (num_rx || num_tx);
+		// Polling only reads the control register. Meanwhile, let the
+		// IRQ handler receive the messages (see bh_run_rx_inline()).
+		wdev->hif.polling = true;
+		mutex_unlock(&wdev->hif.bh_lock);
+		poll = bh_poll(wdev, num_msg);
+		mutex_lock(&wdev->hif.bh_lock);
+		wdev->hif.polling = false;
+	} while (poll);
 	stats_ind -= stats_cnf;
+	wfx_tx_status_flush(wdev);
 
 	if (last_op_is_rx)
 		ack_sdio_data(wdev);
-	if (!wdev->hif.tx_buffers_used && !work_pending(work)) {
+	if (!wdev->hif.tx_buffers_used && !bh_is_pending(wdev)) {
 		device_release(wdev);
 		release_chip = true;
 	}
 	_trace_bh_stats(stats_ind, stats_req, stats_cnf,
-			wdev->hif.tx_buffers_used, release_chip);
+			wdev->hif.tx_buffers_used, release_chip, stats_batch);
+	mutex_unlock(&wdev->hif.bh_lock);
+}
+
+/*
+ * IRQ handlers run in a thread that can sleep. So, they can receive the
+ * messages themselves instead of waking up bh. It saves a context switch for
+ * each IRQ. Transmissions are still done by bh.
+ *
+ * Return false if bh has to be scheduled instead.
+ */
+static bool bh_run_rx_inline(struct wfx_dev *wdev)
+{
+	bool release_chip = false;
+	int num_rx, num_cnf = 0;
+
+	if (!bh_in_irq || wdev->poll_irq)
+		return false;
+	// If bh is running, it may have already checked ctrl_ready
+	if (!mutex_trylock(&wdev->hif.bh_lock))
+		return false;
+	device_wakeup(wdev);
+	num_rx = bh_work_rx(wdev, 32, &num_cnf);
+	if (num_rx) {
+		bh_napi_schedule(wdev);
+		ack_sdio_data(wdev);
+	}
+	// If bh is polling, it still needs the chip awake
+	if (!wdev->hif.tx_buffers_used && !bh_is_pending(wdev) &&
+	    !wdev->hif.polling) {
+		device_release(wdev);
+		release_chip = true;
+	}
+	_trace_bh_stats(num_rx - num_cnf, 0, num_cnf,
+			wdev->hif.tx_buffers_used, release_chip, 0);
+	mutex_unlock(&wdev->hif.bh_lock);
+	// Confirmations free chip buffers, so pending frames may be sent. If
+	// the limit of messages was reached, bh continues the reception.
+	if (num_cnf || num_rx == 32)
+		bh_schedule(wdev);
+	return true;
+}
+
+static void bh_work(struct work_struct *work)
+{
+	struct wfx_dev *wdev = container_of(work, struct wfx_dev, hif.bh);
+
+	bh_run(wdev);
+}
+
+static void bh_kthread_work(struct kthread_work *work)
+{
+	struct wfx_dev *wdev = container_of(work, struct wfx_dev, hif.bh_kwork);
+
+	bh_run(wdev);
 }
 
 /*
@@ -336,7 +727,8 @@ void wfx_bh_request_rx(struct wfx_dev *wdev)
 	control_reg_read(wdev, &cur);
 	prev = atomic_xchg(&wdev->hif.ctrl_reg, cur);
 	complete(&wdev->hif.ctrl_ready);
-	queue_work(system_highpri_wq, &wdev->hif.bh);
+	if (!bh_run_rx_inline(wdev))
+		bh_schedule(wdev);
 
 	if (!(cur & CTRL_NEXT_LEN_MASK))
 		dev_err(wdev->dev, "unexpected control register value: length field is 0: %04x\n",
@@ -351,7 +743,7 @@ void wfx_bh_request_rx(struct wfx_dev *wdev)
  */
 void wfx_bh_request_tx(struct wfx_dev *wdev)
 {
-	queue_work(system_highpri_wq, &wdev->hif.bh);
+	bh_schedule(wdev);
 }
 
 /*
@@ -383,14 +775,120 @@ void wfx_bh_poll_irq(struct wfx_dev *wdev)
 	wfx_bh_request_rx(wdev);
 }
 
-void wfx_bh_register(struct wfx_dev *wdev)
+/*
+ * Running bh in a dedicated thread allows to choose its scheduling policy and
+ * to isolate it from the application cores.
+ */
+static void bh_create_thread(struct wfx_dev *wdev)
 {
+#if (KERNEL_VERSION(4, 9, 0) > LINUX_VERSION_CODE)
+	dev_warn(wdev->dev, "bh_thread is not supported on this kernel\n");
+#else
+	struct kthread_worker *worker;
+	cpumask_var_t cpus;
+#if (KERNEL_VERSION(5, 9, 0) > LINUX_VERSION_CODE)
+	struct sched_param param = {
+		.sched_priority = min(bh_rt_prio, MAX_RT_PRIO - 1U),
+	};
+#endif
+
+	worker = kthread_create_worker(0, "wfx_bh/%s", dev_name(wdev->dev));
+	if (IS_ERR(worker)) {
+		dev_warn(wdev->dev, "cannot create bh thread, use system workqueue\n");
+		return;
+	}
+	if (!bh_rt_prio)
+		set_user_nice(worker->task, MIN_NICE);
+	else
+#if (KERNEL_VERSION(5, 9, 0) > LINUX_VERSION_CODE)
+		sched_setscheduler(worker->task, SCHED_FIFO, &param);
+#else
+		// Modules are no more allowed to choose the RT priority. The
+		// value of bh_rt_prio is ignored.
+		sched_set_fifo(worker->task);
+#endif
+	if (bh_cpus && *bh_cpus && alloc_cpumask_var(&cpus, GFP_KERNEL)) {
+		if (cpulist_parse(bh_cpus, cpus) || cpumask_empty(cpus) ||
+		    set_cpus_allowed_ptr(worker->task, cpus))
+			dev_warn(wdev->dev, "ignoring invalid CPU list: %s\n",
+				 bh_cpus);
+		free_cpumask_var(cpus);
+	}
+	rcu_assign_pointer(wdev->hif.bh_worker, worker);
+#endif
+}
+
+/*
+ * NAPI needs a net_device. Since Linux 6.10, a dummy net_device must be
+ * allocated with alloc_netdev_dummy().
+ */
+static struct net_device *bh_alloc_napi_dev(void)
+{
+#if (KERNEL_VERSION(6, 10, 0) > LINUX_VERSION_CODE)
+	struct net_device *dev;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (dev)
+		init_dummy_netdev(dev);
+	return dev;
+#else
+	return alloc_netdev_dummy(0);
+#endif
+}
+
+static void bh_free_napi_dev(struct net_device *dev)
+{
+#if (KERNEL_VERSION(6, 10, 0) > LINUX_VERSION_CODE)
+	kfree(dev);
+#else
+	free_netdev(dev);
+#endif
+}
+
+int wfx_bh_register(struct wfx_dev *wdev)
+{
+	wdev->hif.napi_dev = bh_alloc_napi_dev();
+	if (!wdev->hif.napi_dev)
+		return -ENOMEM;
+	mutex_init(&wdev->hif.bh_lock);
 	INIT_WORK(&wdev->hif.bh, bh_work);
+	kthread_init_work(&wdev->hif.bh_kwork, bh_kthread_work);
+	if (bh_thread)
+		bh_create_thread(wdev);
 	init_completion(&wdev->hif.ctrl_ready);
 	init_waitqueue_head(&wdev->hif.tx_buffers_empty);
+	skb_queue_head_init(&wdev->hif.rx_pool);
+	skb_queue_head_init(&wdev->hif.rx_napi_queue);
+#if (KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE)
+	netif_napi_add(wdev->hif.napi_dev, &wdev->hif.napi, bh_napi_poll,
+		       NAPI_POLL_WEIGHT);
+#else
+	netif_napi_add(wdev->hif.napi_dev, &wdev->hif.napi, bh_napi_poll);
+#endif
+	napi_enable(&wdev->hif.napi);
+	return 0;
 }
 
 void wfx_bh_unregister(struct wfx_dev *wdev)
 {
+	struct kthread_worker *worker;
+
+	// bh may still be requested once the IRQ is unsubscribed (eg. by the
+	// completion of an asynchronous transfer). Redirect these requests to
+	// the workqueue before destroying the thread.
+	worker = rcu_dereference_protected(wdev->hif.bh_worker, true);
+	if (worker) {
+		RCU_INIT_POINTER(wdev->hif.bh_worker, NULL);
+		synchronize_rcu();
+		kthread_destroy_worker(worker);
+	}
+	if (wdev->hwbus_ops->flush)
+		wdev->hwbus_ops->flush(wdev->hwbus_priv);
 	flush_work(&wdev->hif.bh);
+	skb_queue_purge(&wdev->hif.rx_pool);
+	napi_disable(&wdev->hif.napi);
+	netif_napi_del(&wdev->hif.napi);
+	skb_queue_purge(&wdev->hif.rx_napi_queue);
+	bh_free_napi_dev(wdev->hif.napi_dev);
+	wdev->hif.napi_dev = NULL;
 }
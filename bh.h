@@ -9,25 +9,51 @@
 #define WFX_BH_H
 
 #include <linux/atomic.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
 
 struct wfx_dev;
 
 struct wfx_hif {
 	struct work_struct bh;
+	// If not NULL, bh runs in this thread instead of the system workqueue
+	struct kthread_worker __rcu *bh_worker;
+	struct kthread_work bh_kwork;
 	struct completion ctrl_ready;
 	wait_queue_head_t tx_buffers_empty;
 	atomic_t ctrl_reg;
 	int rx_seqnum;
 	int tx_seqnum;
 	int tx_buffers_used;
+	// Errors of the asynchronous transfers (see wfx_bh_tx_done())
+	unsigned long tx_async_err;
+	// Serialize bh runs and the receptions done from the IRQ handler
+	struct mutex bh_lock;
+	// Only accessed by bh
+	bool irq_masked;
+	// bh polls the chip without holding bh_lock. Protected by bh_lock
+	bool polling;
+	struct sk_buff_head rx_pool;
+	unsigned long rx_pool_hits;
+	unsigned long rx_pool_misses;
+	unsigned long rx_pool_recycled;
+	// Frames waiting to be delivered to mac80211
+	struct sk_buff_head rx_napi_queue;
+	struct napi_struct napi;
+	struct net_device *napi_dev;
 };
 
-void wfx_bh_register(struct wfx_dev *wdev);
+int wfx_bh_register(struct wfx_dev *wdev);
 void wfx_bh_unregister(struct wfx_dev *wdev);
 void wfx_bh_request_rx(struct wfx_dev *wdev);
 void wfx_bh_request_tx(struct wfx_dev *wdev);
 void wfx_bh_poll_irq(struct wfx_dev *wdev);
+void wfx_bh_queue_rx(struct wfx_dev *wdev, struct sk_buff *skb);
+void wfx_bh_rx_recycle(struct wfx_dev *wdev, struct sk_buff *skb);
+void wfx_bh_tx_done(struct wfx_dev *wdev, void *cookie, int status);
 
 #endif /* WFX_BH_H */
@@ -20,6 +20,9 @@
 #define WFX_REG_SET_GEN_R_W   0x6
 #define WFX_REG_FRAME_OUT     0x7
 
+// Maximum number of messages sent in one call to copy_to_io_multi()
+#define WFX_BUS_MAX_BATCH     16
+
 struct hwbus_ops {
 	int (*copy_from_io)(void *bus_priv, unsigned int addr,
 			    void *dst, size_t count);
@@ -30,9 +33,40 @@ struct hwbus_ops {
 	void (*lock)(void *bus_priv);
 	void (*unlock)(void *bus_priv);
 	size_t (*align_size)(void *bus_priv, size_t size);
+	// The chip expects a register access to acknowledge the received
+	// messages (see ack_sdio_data())
+	bool rx_ack;
+	// Optional. Write several buffers to the same register in one bus
+	// transaction. Each buffer is seen as a separated access by the chip.
+	int (*copy_to_io_multi)(void *bus_priv, unsigned int addr,
+				void * const *src, const size_t *count,
+				int num);
+	// Optional. Same as copy_to_io_multi(), but return before the end of
+	// the transfer. Buffers must stay valid until the bus calls
+	// wfx_bh_tx_done() with cookie.
+	int (*copy_to_io_async)(void *bus_priv, unsigned int addr,
+				void * const *src, const size_t *count,
+				int num, void *cookie);
+	// Mandatory if copy_to_io_async is provided. Wait for the end of all
+	// the asynchronous transfers.
+	void (*flush)(void *bus_priv);
 };
 
 extern struct sdio_driver wfx_sdio_driver;
 extern struct spi_driver wfx_spi_driver;
 
+#ifdef CONFIG_WFX_EMUL
+int wfx_emul_register(void);
+void wfx_emul_unregister(void);
+#else
+static inline int wfx_emul_register(void)
+{
+	return 0;
+}
+
+static inline void wfx_emul_unregister(void)
+{
+}
+#endif
+
 #endif
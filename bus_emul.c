@@ -0,0 +1,948 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Emulated bus. Allow to run the driver without any chip.
+ *
+ * This bus mimics the register interface of the chip and a very simple
+ * firmware that answers to every request. It is intended to measure the
+ * performances of the host side of the driver (bh, queues, hif). Bus timings
+ * can be tuned with emul_latency_us and emul_bandwidth.
+ *
+ * Copyright (c) 2017-2020, Silicon Laboratories, Inc.
+ */
+#include <linux/module.h>
+#include <linux/bitfield.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/etherdevice.h>
+#include <linux/platform_device.h>
+#include <linux/seq_file.h>
+#include <linux/timex.h>
+
+#include "bus.h"
+#include "wfx.h"
+#include "hwio.h"
+#include "main.h"
+#include "bh.h"
+#include "hif_api_cmd.h"
+#include "hif_api_mib.h"
+
+static unsigned int emul_count;
+module_param(emul_count, uint, 0444);
+MODULE_PARM_DESC(emul_count, "number of emulated devices to create (default: 0).");
+
+static unsigned int emul_latency_us;
+module_param(emul_latency_us, uint, 0644);
+MODULE_PARM_DESC(emul_latency_us, "emulated setup time of each bus access in microseconds (default: 0).");
+
+static unsigned int emul_bandwidth;
+module_param(emul_bandwidth, uint, 0644);
+MODULE_PARM_DESC(emul_bandwidth, "emulated bus bandwidth in kbit/s. 0 means infinite (default: 0).");
+
+#define EMUL_MAX_DEVICES       4
+#define EMUL_NUM_INP_CH_BUFS   30
+#define EMUL_SIZE_INP_CH_BUF   1616
+#define EMUL_MAX_TX_CNF        16
+
+static const struct wfx_platform_data wfx_emul_pdata = {
+	// No firmware nor PDS to send to an emulated chip
+	.file_fw = NULL,
+	.file_pds = NULL,
+};
+
+struct wfx_emul_msg {
+	struct list_head link;
+	size_t len;
+	u8 data[];
+};
+
+struct wfx_emul_stats {
+	ktime_t start;
+	u64 num_reads;
+	u64 num_writes;
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 num_req;
+	u64 num_tx;
+	u64 num_cnf;
+	u64 num_ind;
+	u64 num_irq;
+	int max_bufs_used;
+};
+
+struct wfx_emul_bench {
+	int remaining;
+	int num_frames;
+	u32 frame_len;
+	ktime_t start;
+	cycles_t start_cycles;
+	s64 duration_ns;
+	cycles_t duration_cycles;
+};
+
+struct wfx_emul_priv {
+	struct platform_device *pdev;
+	struct wfx_dev *core;
+	struct mutex bus_lock;
+	// Protect everything below
+	spinlock_t lock;
+	struct list_head in_queue;
+	struct list_head out_queue;
+	struct work_struct fw_work;
+	struct work_struct irq_work;
+	bool irq_enabled;
+	bool host_aware;
+	bool booted;
+	bool multi_tx_cnf;
+	int seqnum;
+	int bufs_used;
+	u32 config_reg;
+	u32 control_reg;
+	u32 igpr[128];
+	u8 mac_addr[ETH_ALEN];
+	struct wfx_emul_stats stats;
+	struct wfx_emul_bench bench_rx;
+	struct wfx_emul_bench bench_tx;
+};
+
+static struct platform_device *wfx_emul_devices[EMUL_MAX_DEVICES];
+
+static void wfx_emul_bus_delay(size_t count)
+{
+	unsigned long delay_us = emul_latency_us;
+
+	if (emul_bandwidth)
+		delay_us += DIV_ROUND_UP(count * 8 * 1000, emul_bandwidth);
+	if (delay_us > 10)
+		usleep_range(delay_us, delay_us + delay_us / 8 + 1);
+	else if (delay_us)
+		udelay(delay_us);
+}
+
+static struct wfx_emul_msg *wfx_emul_alloc_msg(int id, int if_id,
+					       size_t body_len, void **body)
+{
+	size_t len = sizeof(struct hif_msg) + body_len;
+	struct wfx_emul_msg *msg;
+	struct hif_msg *hif;
+
+	msg = kzalloc(sizeof(*msg) + len, GFP_KERNEL);
+	if (!msg)
+		return NULL;
+	msg->len = len;
+	hif = (struct hif_msg *)msg->data;
+	hif->len = cpu_to_le16(len);
+	hif->id = id;
+	hif->interface = if_id;
+	*body = hif->body;
+	return msg;
+}
+
+// Must be called under bus->lock
+static u32 wfx_emul_next_len(struct wfx_emul_priv *bus)
+{
+	struct wfx_emul_msg *msg;
+
+	msg = list_first_entry_or_null(&bus->out_queue, struct wfx_emul_msg,
+				       link);
+	if (!msg)
+		return 0;
+	return round_up(msg->len, 2) / 2;
+}
+
+// Must be called under bus->lock
+static void wfx_emul_raise_irq(struct wfx_emul_priv *bus)
+{
+	if (bus->host_aware || !bus->irq_enabled ||
+	    !(bus->config_reg & CFG_IRQ_ENABLE_DATA) ||
+	    list_empty(&bus->out_queue))
+		return;
+	bus->host_aware = true;
+	bus->stats.num_irq++;
+	queue_work(system_highpri_wq, &bus->irq_work);
+}
+
+// Called under bus->lock
+static void wfx_emul_bench_count(struct wfx_emul_bench *bench)
+{
+	if (!bench->remaining)
+		return;
+	bench->remaining--;
+	if (!bench->remaining) {
+		bench->duration_ns = ktime_to_ns(ktime_sub(ktime_get(),
+							   bench->start));
+		bench->duration_cycles = get_cycles() - bench->start_cycles;
+	}
+}
+
+// Called under bus->lock
+static void wfx_emul_bench_start(struct wfx_emul_bench *bench, int num)
+{
+	bench->num_frames = num;
+	bench->remaining = num;
+	bench->start = ktime_get();
+	bench->start_cycles = get_cycles();
+}
+
+static void wfx_emul_send(struct wfx_emul_priv *bus, struct wfx_emul_msg *msg)
+{
+	struct hif_msg *hif = (struct hif_msg *)msg->data;
+
+	spin_lock_bh(&bus->lock);
+	hif->seqnum = bus->seqnum;
+	bus->seqnum = (bus->seqnum + 1) % (HIF_COUNTER_MAX + 1);
+	if (hif->id & HIF_ID_IS_INDICATION)
+		bus->stats.num_ind++;
+	else
+		bus->stats.num_cnf++;
+	list_add_tail(&msg->link, &bus->out_queue);
+	wfx_emul_raise_irq(bus);
+	spin_unlock_bh(&bus->lock);
+}
+
+static void wfx_emul_release_buf(struct wfx_emul_priv *bus)
+{
+	spin_lock_bh(&bus->lock);
+	WARN_ON(!bus->bufs_used);
+	bus->bufs_used--;
+	spin_unlock_bh(&bus->lock);
+}
+
+static void wfx_emul_send_startup(struct wfx_emul_priv *bus)
+{
+	struct hif_ind_startup *body;
+	struct wfx_emul_msg *msg;
+
+	msg = wfx_emul_alloc_msg(HIF_IND_ID_STARTUP, 0, sizeof(*body),
+				 (void **)&body);
+	if (!msg)
+		return;
+	body->num_inp_ch_bufs = (__force u16)cpu_to_le16(EMUL_NUM_INP_CH_BUFS);
+	body->size_inp_ch_buf = (__force u16)cpu_to_le16(EMUL_SIZE_INP_CH_BUF);
+	body->num_links_ap = 14;
+	body->num_interfaces = 2;
+	ether_addr_copy(body->mac_addr[0], bus->mac_addr);
+	ether_addr_copy(body->mac_addr[1], bus->mac_addr);
+	body->mac_addr[1][ETH_ALEN - 1] ^= 0x01;
+	body->api_version_major = 3;
+	body->api_version_minor = 6;
+	body->link_mode = SEC_LINK_UNAVAILABLE;
+	body->firmware_major = 3;
+	body->firmware_minor = 6;
+	body->firmware_type = HIF_FW_TYPE_WFM;
+	body->supported_rate_mask = (__force u32)cpu_to_le32(0x00FF0FFF);
+	strscpy(body->firmware_label, "emulated", sizeof(body->firmware_label));
+	wfx_emul_send(bus, msg);
+}
+
+static void wfx_emul_send_tx_cnf(struct wfx_emul_priv *bus,
+				 struct hif_cnf_tx *cnf, int num, int if_id)
+{
+	struct hif_cnf_multi_transmit *body;
+	struct wfx_emul_msg *msg;
+
+	if (!num)
+		return;
+	if (num == 1) {
+		msg = wfx_emul_alloc_msg(HIF_CNF_ID_TX, if_id, sizeof(*cnf),
+					 (void **)&body);
+		if (!msg)
+			return;
+		memcpy(body, cnf, sizeof(*cnf));
+	} else {
+		msg = wfx_emul_alloc_msg(HIF_CNF_ID_MULTI_TRANSMIT, if_id,
+					 sizeof(*body) + num * sizeof(*cnf),
+					 (void **)&body);
+		if (!msg)
+			return;
+		body->num_tx_confs = num;
+		memcpy(body->tx_conf_payload, cnf, num * sizeof(*cnf));
+	}
+	wfx_emul_send(bus, msg);
+}
+
+static void wfx_emul_fill_tx_cnf(struct hif_cnf_tx *cnf,
+				 const struct hif_msg *hif)
+{
+	const struct hif_req_tx *req = (const struct hif_req_tx *)hif->body;
+	size_t len = le16_to_cpu(hif->len) - sizeof(*hif) - sizeof(*req);
+
+	memset(cnf, 0, sizeof(*cnf));
+	cnf->status = HIF_STATUS_SUCCESS;
+	cnf->packet_id = req->packet_id;
+	// Airtime at 54Mbps plus the legacy preamble
+	cnf->media_delay = cpu_to_le32(DIV_ROUND_UP(len * 8, 54) + 20);
+}
+
+static void wfx_emul_handle_cmd(struct wfx_emul_priv *bus,
+				const struct hif_msg *hif)
+{
+	const struct hif_req_write_mib *mib_req = (const void *)hif->body;
+	const struct hif_req_start_scan_alt *scan_req = (const void *)hif->body;
+	struct hif_cnf_read_mib *mib_cnf;
+	struct hif_ind_scan_cmpl *scan_ind;
+	struct hif_ind_set_pm_mode_cmpl *pm_ind;
+	struct wfx_emul_msg *msg, *ind = NULL;
+	size_t mib_len = 0;
+	__le32 *status;
+
+	switch (hif->id) {
+	case HIF_REQ_ID_SHUT_DOWN:
+		// Chip won't answer anymore
+		return;
+	case HIF_REQ_ID_READ_MIB:
+		if (mib_req->mib_id == cpu_to_le16(HIF_MIB_ID_COUNTERS_TABLE))
+			mib_len = sizeof(struct hif_mib_count_table);
+		if (mib_req->mib_id ==
+		    cpu_to_le16(HIF_MIB_ID_EXTENDED_COUNTERS_TABLE))
+			mib_len = sizeof(struct hif_mib_extended_count_table);
+		msg = wfx_emul_alloc_msg(hif->id, hif->interface,
+					 sizeof(*mib_cnf) + mib_len,
+					 (void **)&mib_cnf);
+		if (!msg)
+			return;
+		mib_cnf->mib_id = mib_req->mib_id;
+		mib_cnf->length = cpu_to_le16(mib_len);
+		wfx_emul_send(bus, msg);
+		return;
+	case HIF_REQ_ID_WRITE_MIB:
+		if (mib_req->mib_id == cpu_to_le16(HIF_MIB_ID_GL_SET_MULTI_MSG))
+			bus->multi_tx_cnf = ((const struct hif_mib_gl_set_multi_msg *)mib_req->mib_data)->enable_multi_tx_conf;
+		break;
+	case HIF_REQ_ID_START_SCAN:
+		ind = wfx_emul_alloc_msg(HIF_IND_ID_SCAN_CMPL, hif->interface,
+					 sizeof(*scan_ind), (void **)&scan_ind);
+		if (ind)
+			scan_ind->num_channels_completed =
+				scan_req->num_of_channels;
+		break;
+	case HIF_REQ_ID_SET_PM_MODE:
+		ind = wfx_emul_alloc_msg(HIF_IND_ID_SET_PM_MODE_CMPL,
+					 hif->interface, sizeof(*pm_ind),
+					 (void **)&pm_ind);
+		break;
+	}
+	// Most of the confirmations only contain a status
+	msg = wfx_emul_alloc_msg(hif->id, hif->interface, sizeof(*status),
+				 (void **)&status);
+	if (msg)
+		wfx_emul_send(bus, msg);
+	if (ind)
+		wfx_emul_send(bus, ind);
+}
+
+static void wfx_emul_fw_work(struct work_struct *work)
+{
+	struct wfx_emul_priv *bus = container_of(work, struct wfx_emul_priv,
+						 fw_work);
+	struct hif_cnf_tx tx_cnf[EMUL_MAX_TX_CNF];
+	struct wfx_emul_msg *req;
+	struct hif_msg *hif;
+	int num_tx_cnf = 0;
+	int tx_if_id = 0;
+
+	for (;;) {
+		spin_lock_bh(&bus->lock);
+		req = list_first_entry_or_null(&bus->in_queue,
+					       struct wfx_emul_msg, link);
+		if (req)
+			list_del(&req->link);
+		spin_unlock_bh(&bus->lock);
+		if (!req)
+			break;
+		hif = (struct hif_msg *)req->data;
+		if (hif->id != HIF_REQ_ID_TX || tx_if_id != hif->interface ||
+		    num_tx_cnf == EMUL_MAX_TX_CNF) {
+			wfx_emul_send_tx_cnf(bus, tx_cnf, num_tx_cnf, tx_if_id);
+			num_tx_cnf = 0;
+		}
+		// Release input buffer before sending the confirmation
+		wfx_emul_release_buf(bus);
+		if (hif->id == HIF_REQ_ID_TX) {
+			tx_if_id = hif->interface;
+			wfx_emul_fill_tx_cnf(&tx_cnf[num_tx_cnf++], hif);
+			if (!bus->multi_tx_cnf) {
+				wfx_emul_send_tx_cnf(bus, tx_cnf, 1, tx_if_id);
+				num_tx_cnf = 0;
+			}
+		} else {
+			wfx_emul_handle_cmd(bus, hif);
+		}
+		kfree(req);
+	}
+	wfx_emul_send_tx_cnf(bus, tx_cnf, num_tx_cnf, tx_if_id);
+}
+
+static void wfx_emul_irq_work(struct work_struct *work)
+{
+	struct wfx_emul_priv *bus = container_of(work, struct wfx_emul_priv,
+						 irq_work);
+
+	wfx_bh_request_rx(bus->core);
+}
+
+static int wfx_emul_read_queue(struct wfx_emul_priv *bus, u8 *dst,
+			       size_t count)
+{
+	struct wfx_emul_msg *msg;
+	__le16 *piggyback;
+	u32 next_len;
+
+	if (WARN_ON(count < sizeof(struct hif_msg) + sizeof(*piggyback)))
+		return -EINVAL;
+	spin_lock_bh(&bus->lock);
+	msg = list_first_entry_or_null(&bus->out_queue, struct wfx_emul_msg,
+				       link);
+	if (!msg) {
+		bus->config_reg |= CFG_ERR_BUF_UNDERRUN;
+		spin_unlock_bh(&bus->lock);
+		memset(dst, 0, count);
+		return 0;
+	}
+	list_del(&msg->link);
+	if (((struct hif_msg *)msg->data)->id == HIF_IND_ID_GENERIC)
+		wfx_emul_bench_count(&bus->bench_rx);
+	next_len = wfx_emul_next_len(bus);
+	// Host will rely on piggyback to get next message
+	bus->host_aware = next_len;
+	spin_unlock_bh(&bus->lock);
+
+	if (msg->len > count - sizeof(*piggyback)) {
+		WARN(1, "host read too short: %zu < %zu", count, msg->len);
+		msg->len = count - sizeof(*piggyback);
+	}
+	memcpy(dst, msg->data, msg->len);
+	memset(dst + msg->len, 0, count - msg->len);
+	piggyback = (__le16 *)(dst + count - sizeof(*piggyback));
+	*piggyback = cpu_to_le16(next_len | CTRL_WLAN_READY);
+	kfree(msg);
+	return 0;
+}
+
+static int wfx_emul_write_queue(struct wfx_emul_priv *bus, const u8 *src,
+				size_t count)
+{
+	const struct hif_msg *hif = (const struct hif_msg *)src;
+	struct wfx_emul_msg *msg;
+	size_t len;
+
+	len = le16_to_cpu(hif->len);
+	if (count < sizeof(*hif) || len > count || len < sizeof(*hif)) {
+		spin_lock_bh(&bus->lock);
+		bus->config_reg |= CFG_ERR_DATA_IN_TOO_LARGE;
+		spin_unlock_bh(&bus->lock);
+		return 0;
+	}
+	msg = kmalloc(sizeof(*msg) + len, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+	msg->len = len;
+	memcpy(msg->data, src, len);
+	spin_lock_bh(&bus->lock);
+	if (bus->bufs_used >= EMUL_NUM_INP_CH_BUFS) {
+		bus->config_reg |= CFG_ERR_BUF_OVERRUN;
+		spin_unlock_bh(&bus->lock);
+		kfree(msg);
+		return 0;
+	}
+	bus->bufs_used++;
+	bus->stats.max_bufs_used = max(bus->stats.max_bufs_used,
+				       bus->bufs_used);
+	bus->stats.num_req++;
+	if (hif->id == HIF_REQ_ID_TX) {
+		bus->stats.num_tx++;
+		wfx_emul_bench_count(&bus->bench_tx);
+	}
+	list_add_tail(&msg->link, &bus->in_queue);
+	spin_unlock_bh(&bus->lock);
+	queue_work(system_highpri_wq, &bus->fw_work);
+	return 0;
+}
+
+// stats is cleared under bus->lock (see wfx_emul_stats_write())
+static void wfx_emul_count_io(struct wfx_emul_priv *bus, bool write,
+			      size_t count)
+{
+	spin_lock_bh(&bus->lock);
+	if (write) {
+		bus->stats.num_writes++;
+		bus->stats.bytes_written += count;
+	} else {
+		bus->stats.num_reads++;
+		bus->stats.bytes_read += count;
+	}
+	spin_unlock_bh(&bus->lock);
+}
+
+static int wfx_emul_copy_from_io(void *priv, unsigned int addr,
+				 void *dst, size_t count)
+{
+	struct wfx_emul_priv *bus = priv;
+	__le32 *reg = dst;
+	u32 val = 0;
+
+	wfx_emul_bus_delay(count);
+	wfx_emul_count_io(bus, false, count);
+	if (addr == WFX_REG_IN_OUT_QUEUE)
+		return wfx_emul_read_queue(bus, dst, count);
+
+	if (WARN_ON(count != sizeof(u32)))
+		return -EINVAL;
+	spin_lock_bh(&bus->lock);
+	switch (addr) {
+	case WFX_REG_CONFIG:
+		val = bus->config_reg | FIELD_PREP(CFG_DEVICE_ID_MAJOR, 1);
+		break;
+	case WFX_REG_CONTROL:
+		val = wfx_emul_next_len(bus);
+		if (val)
+			bus->host_aware = true;
+		val |= bus->control_reg;
+		break;
+	case WFX_REG_SET_GEN_R_W:
+		val = bus->igpr[0];
+		break;
+	}
+	spin_unlock_bh(&bus->lock);
+	*reg = cpu_to_le32(val);
+	return 0;
+}
+
+static int wfx_emul_copy_to_io(void *priv, unsigned int addr,
+			       const void *src, size_t count)
+{
+	struct wfx_emul_priv *bus = priv;
+	const __le32 *reg = src;
+	bool boot = false;
+	u32 val;
+
+	wfx_emul_bus_delay(count);
+	wfx_emul_count_io(bus, true, count);
+	if (addr == WFX_REG_IN_OUT_QUEUE)
+		return wfx_emul_write_queue(bus, src, count);
+
+	if (WARN_ON(count != sizeof(u32)))
+		return -EINVAL;
+	val = le32_to_cpu(*reg);
+	spin_lock_bh(&bus->lock);
+	switch (addr) {
+	case WFX_REG_CONFIG:
+		// Prefetch is immediate and error bits are cleared on write
+		val &= ~(CFG_PREFETCH_AHB | CFG_PREFETCH_SRAM | 0xFF |
+			 CFG_DEVICE_ID_MAJOR);
+		bus->config_reg = val;
+		if (!bus->booted && !(val & CFG_CPU_RESET) &&
+		    !(val & CFG_DIRECT_ACCESS_MODE)) {
+			bus->booted = true;
+			boot = true;
+		}
+		wfx_emul_raise_irq(bus);
+		break;
+	case WFX_REG_CONTROL:
+		if (val & CTRL_WLAN_WAKEUP)
+			bus->control_reg |= CTRL_WLAN_READY;
+		break;
+	case WFX_REG_SET_GEN_R_W:
+		if (val & IGPR_RW)
+			bus->igpr[0] = bus->igpr[FIELD_GET(IGPR_INDEX, val)];
+		else
+			bus->igpr[FIELD_GET(IGPR_INDEX, val)] =
+				FIELD_GET(IGPR_VALUE, val);
+		break;
+	}
+	spin_unlock_bh(&bus->lock);
+	if (boot)
+		wfx_emul_send_startup(bus);
+	return 0;
+}
+
+static int wfx_emul_copy_to_io_multi(void *priv, unsigned int addr,
+				     void * const *src, const size_t *count,
+				     int num)
+{
+	struct wfx_emul_priv *bus = priv;
+	size_t total = 0;
+	int ret = 0;
+	int i;
+
+	if (WARN_ON(addr != WFX_REG_IN_OUT_QUEUE))
+		return -EINVAL;
+	for (i = 0; i < num; i++)
+		total += count[i];
+	// Setup cost is only paid once for the whole batch
+	wfx_emul_bus_delay(total);
+	wfx_emul_count_io(bus, true, total);
+	for (i = 0; i < num && !ret; i++)
+		ret = wfx_emul_write_queue(bus, src[i], count[i]);
+	return ret;
+}
+
+static void wfx_emul_lock(void *priv)
+{
+	struct wfx_emul_priv *bus = priv;
+
+	mutex_lock(&bus->bus_lock);
+}
+
+static void wfx_emul_unlock(void *priv)
+{
+	struct wfx_emul_priv *bus = priv;
+
+	mutex_unlock(&bus->bus_lock);
+}
+
+static int wfx_emul_irq_subscribe(void *priv)
+{
+	struct wfx_emul_priv *bus = priv;
+
+	spin_lock_bh(&bus->lock);
+	bus->irq_enabled = true;
+	wfx_emul_raise_irq(bus);
+	spin_unlock_bh(&bus->lock);
+	return 0;
+}
+
+static int wfx_emul_irq_unsubscribe(void *priv)
+{
+	struct wfx_emul_priv *bus = priv;
+
+	spin_lock_bh(&bus->lock);
+	bus->irq_enabled = false;
+	spin_unlock_bh(&bus->lock);
+	cancel_work_sync(&bus->irq_work);
+	return 0;
+}
+
+static size_t wfx_emul_align_size(void *priv, size_t size)
+{
+	return ALIGN(size, 4);
+}
+
+static const struct hwbus_ops wfx_emul_hwbus_ops = {
+	.copy_from_io = wfx_emul_copy_from_io,
+	.copy_to_io = wfx_emul_copy_to_io,
+	.irq_subscribe = wfx_emul_irq_subscribe,
+	.irq_unsubscribe = wfx_emul_irq_unsubscribe,
+	.lock = wfx_emul_lock,
+	.unlock = wfx_emul_unlock,
+	.align_size = wfx_emul_align_size,
+	.copy_to_io_multi = wfx_emul_copy_to_io_multi,
+};
+
+static int wfx_emul_stats_show(struct seq_file *seq, void *v)
+{
+	struct wfx_emul_priv *bus = seq->private;
+	struct wfx_emul_stats stats;
+	s64 elapsed_us;
+
+	spin_lock_bh(&bus->lock);
+	stats = bus->stats;
+	spin_unlock_bh(&bus->lock);
+	elapsed_us = max_t(s64, ktime_us_delta(ktime_get(), stats.start), 1);
+	seq_printf(seq, "elapsed:       %lld us\n", elapsed_us);
+	seq_printf(seq, "bus reads:     %llu (%llu bytes)\n",
+		   stats.num_reads, stats.bytes_read);
+	seq_printf(seq, "bus writes:    %llu (%llu bytes)\n",
+		   stats.num_writes, stats.bytes_written);
+	seq_printf(seq, "requests:      %llu (%llu tx)\n",
+		   stats.num_req, stats.num_tx);
+	seq_printf(seq, "confirmations: %llu\n", stats.num_cnf);
+	seq_printf(seq, "indications:   %llu\n", stats.num_ind);
+	seq_printf(seq, "irqs:          %llu\n", stats.num_irq);
+	seq_printf(seq, "max bufs used: %d/%d\n", stats.max_bufs_used,
+		   EMUL_NUM_INP_CH_BUFS);
+	seq_printf(seq, "tx rate:       %llu frames/s\n",
+		   div64_u64(stats.num_tx * USEC_PER_SEC, elapsed_us));
+	return 0;
+}
+
+static int wfx_emul_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wfx_emul_stats_show, inode->i_private);
+}
+
+static ssize_t wfx_emul_stats_write(struct file *file,
+				    const char __user *user_buf,
+				    size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct wfx_emul_priv *bus = seq->private;
+
+	spin_lock_bh(&bus->lock);
+	memset(&bus->stats, 0, sizeof(bus->stats));
+	bus->stats.start = ktime_get();
+	spin_unlock_bh(&bus->lock);
+	return count;
+}
+
+static const struct file_operations wfx_emul_stats_fops = {
+	.open = wfx_emul_stats_open,
+	.read = seq_read,
+	.write = wfx_emul_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void wfx_emul_bench_show(struct seq_file *seq,
+				struct wfx_emul_priv *bus,
+				struct wfx_emul_bench *bench_ptr)
+{
+	struct wfx_emul_bench bench;
+
+	spin_lock_bh(&bus->lock);
+	bench = *bench_ptr;
+	spin_unlock_bh(&bus->lock);
+	if (!bench.num_frames) {
+		seq_puts(seq, "write a number of frames to start\n");
+		return;
+	}
+	if (bench.remaining) {
+		seq_printf(seq, "running: %d/%d frames remaining\n",
+			   bench.remaining, bench.num_frames);
+		return;
+	}
+	if (bench.frame_len)
+		seq_printf(seq, "frames:        %d x %u bytes\n",
+			   bench.num_frames, bench.frame_len);
+	else
+		seq_printf(seq, "frames:        %d\n", bench.num_frames);
+	seq_printf(seq, "duration:      %lld ns\n", bench.duration_ns);
+	seq_printf(seq, "rate:          %llu frames/s\n",
+		   div64_u64((u64)bench.num_frames * NSEC_PER_SEC,
+			     max_t(s64, bench.duration_ns, 1)));
+	seq_printf(seq, "cycles/frame:  %llu\n",
+		   div64_u64((u64)bench.duration_cycles, bench.num_frames));
+}
+
+static int wfx_emul_bench_rx_show(struct seq_file *seq, void *v)
+{
+	struct wfx_emul_priv *bus = seq->private;
+
+	wfx_emul_bench_show(seq, bus, &bus->bench_rx);
+	return 0;
+}
+
+static int wfx_emul_bench_rx_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wfx_emul_bench_rx_show, inode->i_private);
+}
+
+static ssize_t wfx_emul_bench_rx_write(struct file *file,
+				       const char __user *user_buf,
+				       size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct wfx_emul_priv *bus = seq->private;
+	struct hif_ind_generic *body;
+	struct wfx_emul_msg *msg, *tmp;
+	LIST_HEAD(frames);
+	size_t body_len;
+	int num, ret, i;
+
+	ret = kstrtoint_from_user(user_buf, count, 0, &num);
+	if (ret)
+		return ret;
+	if (num <= 0)
+		return -EINVAL;
+	body_len = clamp_t(size_t, bus->bench_rx.frame_len,
+			   sizeof(body->type),
+			   CTRL_NEXT_LEN_MASK * 2 - sizeof(struct hif_msg));
+	for (i = 0; i < num; i++) {
+		// Raw generic indications are silently dropped by the driver
+		msg = wfx_emul_alloc_msg(HIF_IND_ID_GENERIC, 0, body_len,
+					 (void **)&body);
+		if (!msg) {
+			list_for_each_entry_safe(msg, tmp, &frames, link)
+				kfree(msg);
+			return -ENOMEM;
+		}
+		body->type = cpu_to_le32(HIF_GENERIC_INDICATION_TYPE_RAW);
+		list_add_tail(&msg->link, &frames);
+	}
+
+	spin_lock_bh(&bus->lock);
+	if (bus->bench_rx.remaining) {
+		spin_unlock_bh(&bus->lock);
+		list_for_each_entry_safe(msg, tmp, &frames, link)
+			kfree(msg);
+		return -EBUSY;
+	}
+	wfx_emul_bench_start(&bus->bench_rx, num);
+	list_for_each_entry_safe(msg, tmp, &frames, link) {
+		((struct hif_msg *)msg->data)->seqnum = bus->seqnum;
+		bus->seqnum = (bus->seqnum + 1) % (HIF_COUNTER_MAX + 1);
+		bus->stats.num_ind++;
+		list_move_tail(&msg->link, &bus->out_queue);
+	}
+	wfx_emul_raise_irq(bus);
+	spin_unlock_bh(&bus->lock);
+	return count;
+}
+
+static const struct file_operations wfx_emul_bench_rx_fops = {
+	.open = wfx_emul_bench_rx_open,
+	.read = seq_read,
+	.write = wfx_emul_bench_rx_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int wfx_emul_bench_tx_show(struct seq_file *seq, void *v)
+{
+	struct wfx_emul_priv *bus = seq->private;
+
+	wfx_emul_bench_show(seq, bus, &bus->bench_tx);
+	return 0;
+}
+
+static int wfx_emul_bench_tx_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wfx_emul_bench_tx_show, inode->i_private);
+}
+
+/*
+ * Unlike bench_rx, the frames are not generated by the emulated bus. They come
+ * from the network stack (eg. pktgen). The measure starts now and stops once
+ * the requested number of frames have been written to the bus.
+ */
+static ssize_t wfx_emul_bench_tx_write(struct file *file,
+				       const char __user *user_buf,
+				       size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct wfx_emul_priv *bus = seq->private;
+	int num, ret;
+
+	ret = kstrtoint_from_user(user_buf, count, 0, &num);
+	if (ret)
+		return ret;
+	if (num <= 0)
+		return -EINVAL;
+	spin_lock_bh(&bus->lock);
+	if (bus->bench_tx.remaining) {
+		spin_unlock_bh(&bus->lock);
+		return -EBUSY;
+	}
+	wfx_emul_bench_start(&bus->bench_tx, num);
+	spin_unlock_bh(&bus->lock);
+	return count;
+}
+
+static const struct file_operations wfx_emul_bench_tx_fops = {
+	.open = wfx_emul_bench_tx_open,
+	.read = seq_read,
+	.write = wfx_emul_bench_tx_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void wfx_emul_debug_init(struct wfx_emul_priv *bus)
+{
+	struct dentry *d;
+
+	d = debugfs_create_dir("wfx_emul", bus->core->hw->wiphy->debugfsdir);
+	debugfs_create_file("stats", 0644, d, bus, &wfx_emul_stats_fops);
+	debugfs_create_file("bench_rx", 0644, d, bus, &wfx_emul_bench_rx_fops);
+	debugfs_create_u32("bench_rx_len", 0644, d, &bus->bench_rx.frame_len);
+	debugfs_create_file("bench_tx", 0644, d, bus, &wfx_emul_bench_tx_fops);
+}
+
+static void wfx_emul_flush(struct list_head *queue)
+{
+	struct wfx_emul_msg *msg, *tmp;
+
+	list_for_each_entry_safe(msg, tmp, queue, link)
+		kfree(msg);
+	INIT_LIST_HEAD(queue);
+}
+
+static int wfx_emul_probe(struct platform_device *pdev)
+{
+	struct wfx_emul_priv *bus;
+	int ret;
+
+	bus = devm_kzalloc(&pdev->dev, sizeof(*bus), GFP_KERNEL);
+	if (!bus)
+		return -ENOMEM;
+	bus->pdev = pdev;
+	mutex_init(&bus->bus_lock);
+	spin_lock_init(&bus->lock);
+	INIT_LIST_HEAD(&bus->in_queue);
+	INIT_LIST_HEAD(&bus->out_queue);
+	INIT_WORK(&bus->fw_work, wfx_emul_fw_work);
+	INIT_WORK(&bus->irq_work, wfx_emul_irq_work);
+	eth_random_addr(bus->mac_addr);
+	bus->bench_rx.frame_len = 1500;
+	bus->stats.start = ktime_get();
+	platform_set_drvdata(pdev, bus);
+
+	bus->core = wfx_init_common(&pdev->dev, &wfx_emul_pdata,
+				    &wfx_emul_hwbus_ops, bus);
+	if (!bus->core)
+		return -EIO;
+
+	ret = wfx_probe(bus->core);
+	if (ret) {
+		cancel_work_sync(&bus->fw_work);
+		wfx_emul_flush(&bus->in_queue);
+		wfx_emul_flush(&bus->out_queue);
+		return ret;
+	}
+	wfx_emul_debug_init(bus);
+	return 0;
+}
+
+static int wfx_emul_remove(struct platform_device *pdev)
+{
+	struct wfx_emul_priv *bus = platform_get_drvdata(pdev);
+
+	wfx_release(bus->core);
+	cancel_work_sync(&bus->irq_work);
+	cancel_work_sync(&bus->fw_work);
+	wfx_emul_flush(&bus->in_queue);
+	wfx_emul_flush(&bus->out_queue);
+	mutex_destroy(&bus->bus_lock);
+	return 0;
+}
+
+static struct platform_driver wfx_emul_driver = {
+	.probe = wfx_emul_probe,
+	.remove = wfx_emul_remove,
+	.driver = {
+		.name = "wfx-emul",
+	},
+};
+
+int wfx_emul_register(void)
+{
+	struct platform_device *pdev;
+	int ret, i;
+
+	if (!emul_count)
+		return 0;
+	ret = platform_driver_register(&wfx_emul_driver);
+	if (ret)
+		return ret;
+	for (i = 0; i < min_t(int, emul_count, EMUL_MAX_DEVICES); i++) {
+		pdev = platform_device_register_simple("wfx-emul", i, NULL, 0);
+		if (IS_ERR(pdev)) {
+			wfx_emul_unregister();
+			return PTR_ERR(pdev);
+		}
+		wfx_emul_devices[i] = pdev;
+	}
+	return 0;
+}
+
+void wfx_emul_unregister(void)
+{
+	int i;
+
+	if (!emul_count)
+		return;
+	for (i = 0; i < ARRAY_SIZE(wfx_emul_devices); i++) {
+		if (wfx_emul_devices[i])
+			platform_device_unregister(wfx_emul_devices[i]);
+		wfx_emul_devices[i] = NULL;
+	}
+	platform_driver_unregister(&wfx_emul_driver);
+}
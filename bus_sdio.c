@@ -19,6 +19,10 @@
 #include "main.h"
 #include "bh.h"
 
+static unsigned int sdio_blksz = 64;
+module_param(sdio_blksz, uint, 0444);
+MODULE_PARM_DESC(sdio_blksz, "SDIO block size in bytes, a multiple of 4 up to 512 (default: 64).");
+
 static const struct wfx_platform_data wfx_sdio_pdata = {
 	.file_fw = "wfm_wf200",
 	.file_pds = "wf200.pds",
@@ -163,8 +167,31 @@ static const struct hwbus_ops wfx_sdio_hwbus_ops = {
 	.lock			= wfx_sdio_lock,
 	.unlock			= wfx_sdio_unlock,
 	.align_size		= wfx_sdio_align_size,
+	.rx_ack			= true,
 };
 
+/*
+ * Block of 64 bytes is more efficient than 512B for frame sizes < 4k: the
+ * padding added by sdio_align_size() is smaller. Messages smaller than a block
+ * are sent in byte mode. Changing the block size on each transfer would cost
+ * two CMD52, more than the saved block overhead. So, the block size is only
+ * chosen at probe.
+ */
+static void wfx_sdio_set_block_size(struct wfx_sdio_priv *bus)
+{
+	struct sdio_func *func = bus->func;
+	unsigned int blksz = sdio_blksz;
+
+	if (blksz < 4 || blksz > 512 || blksz % 4 ||
+	    blksz > func->card->host->max_blk_size) {
+		dev_warn(&func->dev, "unsupported block size %u, using 64\n",
+			 blksz);
+		blksz = 64;
+	}
+	if (sdio_set_block_size(func, blksz))
+		dev_warn(&func->dev, "cannot set block size to %u\n", blksz);
+}
+
 static const struct of_device_id wfx_sdio_of_match[] = {
 	{ .compatible = "silabs,wfx-sdio" },
 	{ .compatible = "silabs,wf200" },
@@ -209,8 +236,8 @@ static int wfx_sdio_probe(struct sdio_func *func,
 
 	sdio_claim_host(func);
 	ret = sdio_enable_func(func);
-	// Block of 64 bytes is more efficient than 512B for frame sizes < 4k
-	sdio_set_block_size(func, 64);
+	if (!ret)
+		wfx_sdio_set_block_size(bus);
 	sdio_release_host(func);
 	if (ret)
 		goto err0;
@@ -34,11 +34,32 @@ static const struct wfx_platform_data wfx_spi_pdata = {
 	.use_rising_clk = true,
 };
 
+// Number of spi_message that can be in flight at same time
+#define WFX_SPI_ASYNC_DEPTH 4
+
+struct wfx_spi_priv;
+
+struct wfx_spi_async {
+	struct wfx_spi_priv *bus;
+	struct spi_message msg;
+	struct spi_transfer xfers[2 * WFX_BUS_MAX_BATCH];
+	u16 regaddr[WFX_BUS_MAX_BATCH];
+	struct completion done;
+	void *cookie;
+	bool notify;
+};
+
 struct wfx_spi_priv {
 	struct spi_device *func;
 	struct wfx_dev *core;
 	struct gpio_desc *gpio_reset;
 	bool need_swab;
+	// SPI core already serializes the messages. However, the register
+	// accesses share their buffers.
+	struct mutex lock;
+	// Ring of asynchronous transfers. Access is serialized by bh.
+	struct wfx_spi_async async[WFX_SPI_ASYNC_DEPTH];
+	int async_next;
 };
 
 #if (KERNEL_VERSION(4, 19, 14) > LINUX_VERSION_CODE)
@@ -195,12 +216,120 @@ static int wfx_spi_copy_to_io(void *priv, unsigned int addr,
 	return ret;
 }
 
+static void wfx_spi_async_complete(void *context)
+{
+	struct wfx_spi_async *slot = context;
+
+	if (slot->notify)
+		wfx_bh_tx_done(slot->bus->core, slot->cookie, slot->msg.status);
+	complete(&slot->done);
+}
+
+/*
+ * Send several messages with only one spi_message. Chip select is released
+ * between each message, so the chip see them as independent accesses. It
+ * avoids to pay the cost of the SPI message setup for each frame.
+ *
+ * The function returns as soon as the message is queued to the SPI
+ * controller. SPI core keeps the messages of a device ordered, so next
+ * accesses (even synchronous) will happen after this one. Only the slot
+ * reused by the next call is waited for.
+ */
+static struct wfx_spi_async *wfx_spi_submit(struct wfx_spi_priv *bus,
+					    unsigned int addr,
+					    void * const *src,
+					    const size_t *count, int num,
+					    void *cookie, bool notify)
+{
+	struct wfx_spi_async *slot = &bus->async[bus->async_next];
+	struct spi_transfer *t = slot->xfers;
+	int i, ret;
+
+	if (WARN_ON(num > WFX_BUS_MAX_BATCH || addr == WFX_REG_CONFIG))
+		return ERR_PTR(-EINVAL);
+	wait_for_completion(&slot->done);
+	bus->async_next = (bus->async_next + 1) % WFX_SPI_ASYNC_DEPTH;
+
+	memset(slot->xfers, 0, sizeof(slot->xfers));
+	spi_message_init(&slot->msg);
+	slot->msg.complete = wfx_spi_async_complete;
+	slot->msg.context = slot;
+	slot->cookie = cookie;
+	slot->notify = notify;
+	for (i = 0; i < num; i++) {
+		WARN(count[i] % 2, "buffer size must be a multiple of 2");
+		slot->regaddr[i] = (addr << 12) | (count[i] / 2);
+		WARN(slot->regaddr[i] & SET_READ, "bad addr or size overflow");
+		cpu_to_le16s(&slot->regaddr[i]);
+		if (bus->need_swab)
+			swab16s(&slot->regaddr[i]);
+		t[2 * i].tx_buf = &slot->regaddr[i];
+		t[2 * i].len = sizeof(slot->regaddr[i]);
+		t[2 * i + 1].tx_buf = src[i];
+		t[2 * i + 1].len = count[i];
+		// Release CS at the end of each message but the last one
+		t[2 * i + 1].cs_change = i != num - 1;
+		spi_message_add_tail(&t[2 * i], &slot->msg);
+		spi_message_add_tail(&t[2 * i + 1], &slot->msg);
+	}
+	ret = spi_async(bus->func, &slot->msg);
+	if (ret) {
+		// Completion handler won't be called
+		complete(&slot->done);
+		return ERR_PTR(ret);
+	}
+	return slot;
+}
+
+static int wfx_spi_copy_to_io_async(void *priv, unsigned int addr,
+				    void * const *src, const size_t *count,
+				    int num, void *cookie)
+{
+	struct wfx_spi_async *slot;
+
+	slot = wfx_spi_submit(priv, addr, src, count, num, cookie, true);
+	return PTR_ERR_OR_ZERO(slot);
+}
+
+static int wfx_spi_copy_to_io_multi(void *priv, unsigned int addr,
+				    void * const *src, const size_t *count,
+				    int num)
+{
+	struct wfx_spi_async *slot;
+	int ret;
+
+	slot = wfx_spi_submit(priv, addr, src, count, num, NULL, false);
+	if (IS_ERR(slot))
+		return PTR_ERR(slot);
+	wait_for_completion(&slot->done);
+	ret = slot->msg.status;
+	complete(&slot->done);
+	return ret;
+}
+
+static void wfx_spi_flush(void *priv)
+{
+	struct wfx_spi_priv *bus = priv;
+	int i;
+
+	for (i = 0; i < WFX_SPI_ASYNC_DEPTH; i++) {
+		wait_for_completion(&bus->async[i].done);
+		complete(&bus->async[i].done);
+	}
+}
+
 static void wfx_spi_lock(void *priv)
 {
+	struct wfx_spi_priv *bus = priv;
+
+	mutex_lock(&bus->lock);
 }
 
 static void wfx_spi_unlock(void *priv)
 {
+	struct wfx_spi_priv *bus = priv;
+
+	mutex_unlock(&bus->lock);
 }
 
 static irqreturn_t wfx_spi_irq_handler(int irq, void *priv)
@@ -247,6 +376,9 @@ static const struct hwbus_ops wfx_spi_hwbus_ops = {
 	.lock			= wfx_spi_lock,
 	.unlock			= wfx_spi_unlock,
 	.align_size		= wfx_spi_align_size,
+	.copy_to_io_multi	= wfx_spi_copy_to_io_multi,
+	.copy_to_io_async	= wfx_spi_copy_to_io_async,
+	.flush			= wfx_spi_flush,
 };
 
 static int wfx_spi_probe(struct spi_device *func)
@@ -255,7 +387,7 @@ static int wfx_spi_probe(struct spi_device *func)
 	bool invert = spi_get_device_id(func)->driver_data & WFX_RESET_INVERTED;
 #endif
 	struct wfx_spi_priv *bus;
-	int ret;
+	int ret, i;
 
 	if (!func->bits_per_word)
 		func->bits_per_word = 16;
@@ -277,8 +409,14 @@ static int wfx_spi_probe(struct spi_device *func)
 	if (!bus)
 		return -ENOMEM;
 	bus->func = func;
+	mutex_init(&bus->lock);
 	if (func->bits_per_word == 8 || IS_ENABLED(CONFIG_CPU_BIG_ENDIAN))
 		bus->need_swab = true;
+	for (i = 0; i < WFX_SPI_ASYNC_DEPTH; i++) {
+		bus->async[i].bus = bus;
+		init_completion(&bus->async[i].done);
+		complete(&bus->async[i].done);
+	}
 	spi_set_drvdata(func, bus);
 
 	bus->gpio_reset = devm_gpiod_get_optional(&func->dev, "reset",
@@ -90,7 +90,7 @@ void wfx_rx_cb(struct wfx_vif *wvif,
 		goto drop;
 	}
 
-	ieee80211_rx_irqsafe(wvif->wdev->hw, skb);
+	wfx_bh_queue_rx(wvif->wdev, skb);
 	return;
 
 drop:
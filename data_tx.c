@@ -7,6 +7,7 @@
  */
 #include <net/mac80211.h>
 #include <linux/etherdevice.h>
+#include <linux/jhash.h>
 
 #include "data_tx.h"
 #include "wfx.h"
@@ -63,12 +64,14 @@ static void wfx_tx_policy_build(struct wfx_vif *wvif, struct tx_policy *policy,
 			count <<= 4;
 		policy->rates[rateid / 2] |= count;
 	}
+	policy->hash = jhash(policy->rates, sizeof(policy->rates), 0);
 }
 
 static bool tx_policy_is_equal(const struct tx_policy *a,
 			       const struct tx_policy *b)
 {
-	return !memcmp(a->rates, b->rates, sizeof(a->rates));
+	return a->hash == b->hash &&
+	       !memcmp(a->rates, b->rates, sizeof(a->rates));
 }
 
 static int wfx_tx_policy_find(struct tx_policy_cache *cache,
@@ -76,10 +79,7 @@ static int wfx_tx_policy_find(struct tx_policy_cache *cache,
 {
 	struct tx_policy *it;
 
-	list_for_each_entry(it, &cache->used, link)
-		if (tx_policy_is_equal(wanted, it))
-			return it - cache->cache;
-	list_for_each_entry(it, &cache->free, link)
+	hash_for_each_possible(cache->hash, it, hnode, wanted->hash)
 		if (tx_policy_is_equal(wanted, it))
 			return it - cache->cache;
 	return -1;
@@ -128,13 +128,18 @@ static int wfx_tx_policy_get(struct wfx_vif *wvif,
 		 */
 		entry = list_entry(cache->free.prev, struct tx_policy, link);
 		memcpy(entry->rates, wanted.rates, sizeof(entry->rates));
+		entry->hash = wanted.hash;
+		hash_del(&entry->hnode);
+		hash_add(cache->hash, &entry->hnode, entry->hash);
 		entry->uploaded = false;
 		entry->usage_count = 0;
 		idx = entry - cache->cache;
 	}
 	wfx_tx_policy_use(cache, &cache->cache[idx]);
-	if (list_empty(&cache->free))
+	if (list_empty(&cache->free)) {
+		set_bit(wvif->id, &wvif->wdev->tx_policy_full);
 		ieee80211_stop_queues(wvif->wdev->hw);
+	}
 	spin_unlock_bh(&cache->lock);
 	return idx;
 }
@@ -149,34 +154,70 @@ static void wfx_tx_policy_put(struct wfx_vif *wvif, int idx)
 	spin_lock_bh(&cache->lock);
 	locked = list_empty(&cache->free);
 	usage = wfx_tx_policy_release(cache, &cache->cache[idx]);
-	if (locked && !usage)
-		ieee80211_wake_queues(wvif->wdev->hw);
+	if (locked && !usage) {
+		clear_bit(wvif->id, &wvif->wdev->tx_policy_full);
+		wfx_tx_limit_wake_queues(wvif->wdev);
+	}
+	spin_unlock_bh(&cache->lock);
+}
+
+// Same than wfx_tx_policy_put() for the frames of skbs that belong to wvif
+static void wfx_tx_policy_put_multi(struct wfx_vif *wvif,
+				    struct sk_buff **skbs, int num)
+{
+	struct tx_policy_cache *cache = &wvif->tx_policy_cache;
+	struct hif_req_tx *req;
+	struct hif_msg *hif;
+	bool locked;
+	int i;
+
+	spin_lock_bh(&cache->lock);
+	locked = list_empty(&cache->free);
+	for (i = 0; i < num; i++) {
+		if (!skbs[i])
+			continue;
+		hif = (struct hif_msg *)skbs[i]->data;
+		req = (struct hif_req_tx *)hif->body;
+		if (hif->interface != wvif->id ||
+		    req->retry_policy_index == HIF_TX_RETRY_POLICY_INVALID)
+			continue;
+		wfx_tx_policy_release(cache,
+				      &cache->cache[req->retry_policy_index]);
+	}
+	if (locked && !list_empty(&cache->free)) {
+		clear_bit(wvif->id, &wvif->wdev->tx_policy_full);
+		wfx_tx_limit_wake_queues(wvif->wdev);
+	}
 	spin_unlock_bh(&cache->lock);
 }
 
+// All the new policies are sent in one request
 static int wfx_tx_policy_upload(struct wfx_vif *wvif)
 {
 	struct tx_policy *policies = wvif->tx_policy_cache.cache;
-	u8 tmp_rates[12];
-	int i, is_used;
+	u8 tmp_rates[HIF_TX_RETRY_POLICY_MAX][12];
+	u8 indexes[HIF_TX_RETRY_POLICY_MAX];
+	int i, num, is_used;
 
 	do {
+		num = 0;
 		spin_lock_bh(&wvif->tx_policy_cache.lock);
 		for (i = 0; i < ARRAY_SIZE(wvif->tx_policy_cache.cache); ++i) {
 			is_used = memzcmp(policies[i].rates,
 					  sizeof(policies[i].rates));
-			if (!policies[i].uploaded && is_used)
-				break;
-		}
-		if (i < ARRAY_SIZE(wvif->tx_policy_cache.cache)) {
+			if (policies[i].uploaded || !is_used)
+				continue;
 			policies[i].uploaded = true;
-			memcpy(tmp_rates, policies[i].rates, sizeof(tmp_rates));
-			spin_unlock_bh(&wvif->tx_policy_cache.lock);
-			hif_set_tx_rate_retry_policy(wvif, i, tmp_rates);
-		} else {
-			spin_unlock_bh(&wvif->tx_policy_cache.lock);
+			indexes[num] = i;
+			memcpy(tmp_rates[num], policies[i].rates,
+			       sizeof(tmp_rates[num]));
+			num++;
 		}
-	} while (i < ARRAY_SIZE(wvif->tx_policy_cache.cache));
+		spin_unlock_bh(&wvif->tx_policy_cache.lock);
+		if (num)
+			hif_set_tx_rate_retry_policy(wvif, indexes,
+						     &tmp_rates[0][0], num);
+	} while (num);
 	return 0;
 }
 
@@ -199,9 +240,12 @@ void wfx_tx_policy_init(struct wfx_vif *wvif)
 	spin_lock_init(&cache->lock);
 	INIT_LIST_HEAD(&cache->used);
 	INIT_LIST_HEAD(&cache->free);
+	hash_init(cache->hash);
 
-	for (i = 0; i < ARRAY_SIZE(cache->cache); ++i)
+	for (i = 0; i < ARRAY_SIZE(cache->cache); ++i) {
+		INIT_HLIST_NODE(&cache->cache[i].hnode);
 		list_add(&cache->cache[i].link, &cache->free);
+	}
 }
 
 /* Tx implementation */
@@ -326,6 +370,18 @@ static int wfx_tx_get_icv_len(struct ieee80211_key_conf *hw_key)
 	return hw_key->icv_len + mic_space;
 }
 
+static void wfx_tx_set_deadline(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	u32 lifetime = wdev->tx_lifetime[skb_get_queue_mapping(skb)];
+	struct wfx_tx_priv *tx_priv = wfx_skb_tx_priv(skb);
+
+	if (!lifetime)
+		return;
+	tx_priv->deadline = ktime_to_us(ktime_get()) + lifetime * USEC_PER_MSEC;
+	if (!tx_priv->deadline)
+		tx_priv->deadline = 1;
+}
+
 static int wfx_tx_inner(struct wfx_vif *wvif, struct ieee80211_sta *sta,
 			struct sk_buff *skb)
 {
@@ -344,6 +400,7 @@ static int wfx_tx_inner(struct wfx_vif *wvif, struct ieee80211_sta *sta,
 
 	// From now tx_info->control is unusable
 	memset(tx_info->rate_driver_data, 0, sizeof(struct wfx_tx_priv));
+	wfx_tx_set_deadline(wvif->wdev, skb);
 
 	// Fill hif_msg
 	WARN(skb_headroom(skb) < wmsg_len, "not enough space in skb");
@@ -384,6 +441,7 @@ static int wfx_tx_inner(struct wfx_vif *wvif, struct ieee80211_sta *sta,
 		req->short_gi = 1;
 
 	// Auxiliary operations
+	wfx_tx_limit_queued(wvif->wdev, skb);
 	wfx_tx_queues_put(wvif, skb);
 	if (tx_info->flags & IEEE80211_TX_CTL_SEND_AFTER_DTIM)
 		schedule_work(&wvif->update_tim_work);
@@ -391,12 +449,22 @@ static int wfx_tx_inner(struct wfx_vif *wvif, struct ieee80211_sta *sta,
 	return 0;
 }
 
-void wfx_tx(struct ieee80211_hw *hw, struct ieee80211_tx_control *control,
-	    struct sk_buff *skb)
+/*
+ * mac80211 forbids to mix ieee80211_tx_status() and
+ * ieee80211_tx_status_irqsafe() and the calls to ieee80211_tx_status() must be
+ * serialized. So, the frames dropped outside of the confirmation path are
+ * queued here and bh reports them along with the confirmed frames.
+ */
+static void wfx_tx_status_defer(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	skb_queue_tail(&wdev->tx_status, skb);
+	wfx_bh_request_tx(wdev);
+}
+
+static void __wfx_tx(struct wfx_dev *wdev, struct ieee80211_sta *sta,
+		     struct sk_buff *skb)
 {
-	struct wfx_dev *wdev = hw->priv;
 	struct wfx_vif *wvif;
-	struct ieee80211_sta *sta = control ? control->sta : NULL;
 	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
 	struct ieee80211_hdr *hdr = (struct ieee80211_hdr *)skb->data;
 	size_t driver_data_room = sizeof_field(struct ieee80211_tx_info,
@@ -424,10 +492,113 @@ void wfx_tx(struct ieee80211_hw *hw, struct ieee80211_tx_control *control,
 	return;
 
 drop:
-	ieee80211_tx_status_irqsafe(wdev->hw, skb);
+	wfx_tx_status_defer(wdev, skb);
 }
 
-static void wfx_skb_dtor(struct wfx_vif *wvif, struct sk_buff *skb)
+void wfx_tx(struct ieee80211_hw *hw, struct ieee80211_tx_control *control,
+	    struct sk_buff *skb)
+{
+	__wfx_tx(hw->priv, control ? control->sta : NULL, skb);
+}
+
+#if (KERNEL_VERSION(5, 5, 0) <= LINUX_VERSION_CODE)
+/*
+ * Frames are left in the mac80211 TXQs (where FQ-CoDel and airtime fairness
+ * apply) until the device has room for them. wfx_tx_queues_get() pulls them
+ * using wfx_tx_pull() once the driver queues are empty.
+ */
+void wfx_wake_tx_queue(struct ieee80211_hw *hw, struct ieee80211_txq *txq)
+{
+	struct wfx_dev *wdev = hw->priv;
+
+	wfx_bh_request_tx(wdev);
+}
+
+// mac80211 adds a subframe header (DA, SA and length) to head when it becomes
+// an A-MSDU and to each new subframe. Each subframe is padded to 4 bytes.
+#define WFX_AMSDU_SUBFRAME_OVERHEAD (ETH_HLEN + 3)
+// wfx_tx_inner() inserts up to 3 bytes to align the 802.11 header on 4 bytes
+#define WFX_TX_ALIGN_MAX 3
+// Largest value of wfx_tx_get_icv_len(): 16 bytes of ICV for GCMP-256 (TKIP
+// only needs 4 bytes of ICV and 8 bytes of MIC)
+#define WFX_TX_ICV_MAX 16
+
+/*
+ * An A-MSDU has to fit in one input buffer of the device, so each A-MSDU
+ * shares one HIF request, one buffer credit and one confirmation. Keep room
+ * for the subframe headers and padding added by mac80211, for the HIF headers
+ * and for the ICV added by wfx_tx_inner().
+ */
+bool wfx_can_aggregate_in_amsdu(struct ieee80211_hw *hw, struct sk_buff *head,
+				struct sk_buff *skb)
+{
+	struct wfx_dev *wdev = hw->priv;
+	int overhead = 2 * WFX_AMSDU_SUBFRAME_OVERHEAD +
+		       sizeof(struct hif_msg) + sizeof(struct hif_req_tx) +
+		       WFX_TX_ALIGN_MAX + WFX_TX_ICV_MAX;
+
+	return head->len + skb->len + overhead <= wdev->hw_caps.size_inp_ch_buf;
+}
+
+static int wfx_tx_pull_ac(struct wfx_dev *wdev, int ac)
+{
+	struct ieee80211_txq *txq;
+	struct sk_buff *skb = NULL;
+
+	local_bh_disable();
+	ieee80211_txq_schedule_start(wdev->hw, ac);
+	txq = ieee80211_next_txq(wdev->hw, ac);
+	if (txq) {
+		skb = ieee80211_tx_dequeue(wdev->hw, txq);
+		if (skb)
+			__wfx_tx(wdev, txq->sta, skb);
+		ieee80211_return_txq(wdev->hw, txq, false);
+	}
+	ieee80211_txq_schedule_end(wdev->hw, ac);
+	local_bh_enable();
+	return skb ? 0 : -ENOENT;
+}
+
+// Move one frame from mac80211 to the driver queues. Return false if there is
+// nothing to pull.
+bool wfx_tx_pull(struct wfx_dev *wdev)
+{
+	int weights[IEEE80211_NUM_ACS] = { };
+	unsigned long tried = 0;
+	struct wfx_queue *queue;
+	struct wfx_vif *wvif;
+	int i, ac;
+
+	// Respect the same priorities than wfx_tx_queues_get_skb()
+	wvif = NULL;
+	while ((wvif = wvif_iterate(wdev, wvif)) != NULL) {
+		for (i = 0; i < IEEE80211_NUM_ACS; i++) {
+			queue = &wvif->tx_queue[i];
+			weights[i] += atomic_read(&queue->weight);
+		}
+	}
+	for (;;) {
+		ac = -1;
+		for (i = 0; i < IEEE80211_NUM_ACS; i++)
+			if (!(tried & BIT(i)) &&
+			    (ac < 0 || weights[i] < weights[ac]))
+				ac = i;
+		if (ac < 0)
+			return false;
+		if (!wfx_tx_pull_ac(wdev, ac))
+			return true;
+		tried |= BIT(ac);
+	}
+}
+#else
+bool wfx_tx_pull(struct wfx_dev *wdev)
+{
+	return false;
+}
+#endif
+
+// Remove the headers added by wfx_tx_inner()
+static void wfx_skb_strip(struct sk_buff *skb)
 {
 	struct hif_msg *hif = (struct hif_msg *)skb->data;
 	struct hif_req_tx *req = (struct hif_req_tx *)hif->body;
@@ -435,10 +606,19 @@ static void wfx_skb_dtor(struct wfx_vif *wvif, struct sk_buff *skb)
 			      sizeof(struct hif_req_tx) +
 			      req->fc_offset;
 
+	skb_pull(skb, offset);
+}
+
+static void wfx_skb_dtor(struct wfx_vif *wvif, struct sk_buff *skb)
+{
+	struct hif_req_tx *req = wfx_skb_txreq(skb);
+
 	WARN_ON(!wvif);
 	wfx_tx_policy_put(wvif, req->retry_policy_index);
-	skb_pull(skb, offset);
-	ieee80211_tx_status_irqsafe(wvif->wdev->hw, skb);
+	wfx_tx_limit_completed(wvif->wdev, skb_get_queue_mapping(skb),
+			       skb->len);
+	wfx_skb_strip(skb);
+	wfx_tx_status_defer(wvif->wdev, skb);
 }
 
 static void wfx_tx_fill_rates(struct wfx_dev *wdev,
@@ -479,26 +659,20 @@ static void wfx_tx_fill_rates(struct wfx_dev *wdev,
 		dev_dbg(wdev->dev, "%d more retries than expected\n", tx_count);
 }
 
-void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg)
+static void wfx_tx_confirm_fill(struct wfx_dev *wdev, struct wfx_vif *wvif,
+				struct sk_buff *skb,
+				const struct hif_cnf_tx *arg)
 {
-	struct ieee80211_tx_info *tx_info;
-	struct wfx_vif *wvif;
-	struct sk_buff *skb;
-
-	skb = wfx_pending_get(wdev, arg->packet_id);
-	if (!skb) {
-		dev_warn(wdev->dev, "received unknown packet_id (%#.8x) from chip\n",
-			 arg->packet_id);
-		return;
-	}
-	tx_info = IEEE80211_SKB_CB(skb);
-	wvif = wdev_to_wvif(wdev, ((struct hif_msg *)skb->data)->interface);
-	WARN_ON(!wvif);
-	if (!wvif)
-		return;
+	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	u32 media_delay = le32_to_cpu(arg->media_delay);
+	u32 queue_delay = le32_to_cpu(arg->tx_queue_delay);
+	// media_delay includes tx_queue_delay. Do not let a bogus value
+	// underflow.
+	u32 airtime = media_delay > queue_delay ? media_delay - queue_delay : 0;
 
 	// Note that wfx_pending_get_pkt_us_delay() get data from tx_info
 	_trace_tx_stats(arg, skb, wfx_pending_get_pkt_us_delay(wdev, skb));
+	wfx_tx_queue_charge_airtime(wvif, skb, airtime);
 	wfx_tx_fill_rates(wdev, tx_info, arg);
 	// From now, you can touch to tx_info->status, but do not touch to
 	// tx_priv anymore
@@ -507,10 +681,10 @@ void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg)
 	memset(tx_info->pad, 0, sizeof(tx_info->pad));
 
 	if (!arg->status) {
+		wfx_tx_limit_update(wdev, skb_get_queue_mapping(skb),
+				    queue_delay);
 #if (KERNEL_VERSION(3, 19, 0) <= LINUX_VERSION_CODE)
-		tx_info->status.tx_time =
-			le32_to_cpu(arg->media_delay) -
-			le32_to_cpu(arg->tx_queue_delay);
+		tx_info->status.tx_time = airtime;
 		if (tx_info->flags & IEEE80211_TX_CTL_NO_ACK)
 			tx_info->flags |= IEEE80211_TX_STAT_NOACK_TRANSMITTED;
 		else
@@ -519,6 +693,8 @@ void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg)
 		if (!(tx_info->flags & IEEE80211_TX_CTL_NO_ACK))
 			tx_info->flags |= IEEE80211_TX_STAT_ACK;
 #endif
+	} else if (arg->status == HIF_STATUS_TX_FAIL_TIMEOUT) {
+		atomic_inc(&wdev->tx_expired_fw[skb_get_queue_mapping(skb)]);
 	} else if (arg->status == HIF_STATUS_TX_FAIL_REQUEUE) {
 		WARN(!arg->requeue, "incoherent status and result_flags");
 		if (tx_info->flags & IEEE80211_TX_CTL_SEND_AFTER_DTIM) {
@@ -527,12 +703,127 @@ void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg)
 		}
 		tx_info->flags |= IEEE80211_TX_STAT_TX_FILTERED;
 	}
-	wfx_skb_dtor(wvif, skb);
+}
+
+/*
+ * Confirmations are processed by batches: the pending frames are retrieved
+ * under one lock, the tx policies and the queue limits are released once per
+ * batch and the frames are handed to mac80211 in one go.
+ */
+#define WFX_TX_CONFIRM_BATCH 32
+
+// Must be called from bh. Also report the frames queued by
+// wfx_tx_status_defer().
+static void wfx_tx_status_report(struct wfx_dev *wdev,
+				 struct sk_buff_head *done)
+{
+	struct sk_buff *skb;
+
+	spin_lock_bh(&wdev->tx_status.lock);
+	skb_queue_splice_tail_init(&wdev->tx_status, done);
+	spin_unlock_bh(&wdev->tx_status.lock);
+	// The bh runs in process context
+	local_bh_disable();
+	while ((skb = __skb_dequeue(done)) != NULL)
+		ieee80211_tx_status(wdev->hw, skb);
+	local_bh_enable();
+}
+
+void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg,
+		       int num)
+{
+	struct sk_buff *skbs[WFX_TX_CONFIRM_BATCH];
+	int bytes[IEEE80211_NUM_ACS];
+	struct sk_buff_head done;
+	struct wfx_vif *wvif;
+	struct hif_msg *hif;
+	int i, j, n;
+
+	__skb_queue_head_init(&done);
+	for (i = 0; i < num; i += n) {
+		n = min(num - i, WFX_TX_CONFIRM_BATCH);
+		memset(bytes, 0, sizeof(bytes));
+		wfx_pending_get_multi(wdev, arg + i, skbs, n);
+		for (j = 0; j < n; j++) {
+			if (!skbs[j]) {
+				dev_warn(wdev->dev, "received unknown packet_id (%#.8x) from chip\n",
+					 arg[i + j].packet_id);
+				continue;
+			}
+			hif = (struct hif_msg *)skbs[j]->data;
+			wvif = wdev_to_wvif(wdev, hif->interface);
+			if (WARN_ON(!wvif)) {
+				skbs[j] = NULL;
+				continue;
+			}
+			wfx_tx_confirm_fill(wdev, wvif, skbs[j], &arg[i + j]);
+			bytes[skb_get_queue_mapping(skbs[j])] += skbs[j]->len;
+		}
+		wvif = NULL;
+		while ((wvif = wvif_iterate(wdev, wvif)) != NULL)
+			wfx_tx_policy_put_multi(wvif, skbs, n);
+		for (j = 0; j < IEEE80211_NUM_ACS; j++)
+			if (bytes[j])
+				wfx_tx_limit_completed(wdev, j, bytes[j]);
+		for (j = 0; j < n; j++) {
+			if (!skbs[j])
+				continue;
+			wfx_skb_strip(skbs[j]);
+			__skb_queue_tail(&done, skbs[j]);
+		}
+	}
+	wfx_tx_status_report(wdev, &done);
+}
+
+// Must be called from bh
+void wfx_tx_status_flush(struct wfx_dev *wdev)
+{
+	struct sk_buff_head done;
+
+	if (skb_queue_empty_lockless(&wdev->tx_status))
+		return;
+	__skb_queue_head_init(&done);
+	wfx_tx_status_report(wdev, &done);
+}
+
+// Called once bh is stopped. mac80211 is already unregistered.
+void wfx_tx_status_purge(struct wfx_dev *wdev)
+{
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&wdev->tx_status)) != NULL)
+		ieee80211_free_txskb(wdev->hw, skb);
+}
+
+static void wfx_tx_report_dropped(struct wfx_dev *wdev,
+				  struct sk_buff_head *dropped)
+{
+	struct wfx_vif *wvif;
+	struct hif_msg *hif;
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(dropped)) != NULL) {
+		hif = (struct hif_msg *)skb->data;
+		wvif = wdev_to_wvif(wdev, hif->interface);
+		ieee80211_tx_info_clear_status(IEEE80211_SKB_CB(skb));
+		wfx_skb_dtor(wvif, skb);
+	}
+}
+
+// Called for frames that reached their deadline before being sent to the chip
+void wfx_tx_report_expired(struct wfx_dev *wdev, struct sk_buff_head *expired)
+{
+	struct sk_buff *skb;
+
+	skb_queue_walk(expired, skb)
+		atomic_inc(&wdev->tx_expired_drv[skb_get_queue_mapping(skb)]);
+	wfx_tx_report_dropped(wdev, expired);
 }
 
 static void wfx_flush_vif(struct wfx_vif *wvif, u32 queues,
 			  struct sk_buff_head *dropped)
 {
+	struct wfx_dev *wdev = wvif->wdev;
 	struct wfx_queue *queue;
 	int i;
 
@@ -543,17 +834,17 @@ static void wfx_flush_vif(struct wfx_vif *wvif, u32 queues,
 		if (dropped)
 			wfx_tx_queue_drop(wvif, queue, dropped);
 	}
-	if (wvif->wdev->chip_frozen)
+	if (wdev->chip_frozen)
 		return;
-	for (i = 0; i < IEEE80211_NUM_ACS; i++) {
-		if (!(BIT(i) & queues))
-			continue;
-		queue = &wvif->tx_queue[i];
-		if (wait_event_timeout(wvif->wdev->tx_dequeue,
-				       wfx_tx_queue_empty(wvif, queue),
-				       msecs_to_jiffies(1000)) <= 0)
-			dev_warn(wvif->wdev->dev,
-				 "frames queued while flushing tx queues?");
+	// Only wait for the frames of the requested queues. The waiters are
+	// woken up each time a queue has no more frames pending in firmware.
+	if (!wait_event_timeout(wdev->tx_dequeue,
+				wfx_tx_queues_flushed(wvif, queues),
+				msecs_to_jiffies(3000))) {
+		dev_warn(wdev->dev, "cannot flush tx queues of vif %d\n",
+			 wvif->id);
+		wfx_pending_dump_old_frames(wdev, 3000);
+		wdev->chip_frozen = true;
 	}
 }
 
@@ -563,8 +854,6 @@ void wfx_flush(struct ieee80211_hw *hw, struct ieee80211_vif *vif,
 	struct wfx_dev *wdev = hw->priv;
 	struct sk_buff_head dropped;
 	struct wfx_vif *wvif;
-	struct hif_msg *hif;
-	struct sk_buff *skb;
 
 	skb_queue_head_init(&dropped);
 	if (vif) {
@@ -575,13 +864,28 @@ void wfx_flush(struct ieee80211_hw *hw, struct ieee80211_vif *vif,
 		while ((wvif = wvif_iterate(wdev, wvif)) != NULL)
 			wfx_flush_vif(wvif, queues, drop ? &dropped : NULL);
 	}
-	wfx_tx_flush(wdev);
 	if (wdev->chip_frozen)
 		wfx_pending_drop(wdev, &dropped);
-	while ((skb = skb_dequeue(&dropped)) != NULL) {
-		hif = (struct hif_msg *)skb->data;
-		wvif = wdev_to_wvif(wdev, hif->interface);
-		ieee80211_tx_info_clear_status(IEEE80211_SKB_CB(skb));
-		wfx_skb_dtor(wvif, skb);
-	}
+	wfx_tx_report_dropped(wdev, &dropped);
 }
+
+#if (KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE)
+void wfx_flush_sta(struct ieee80211_hw *hw, struct ieee80211_vif *vif,
+		   struct ieee80211_sta *sta)
+{
+	struct wfx_sta_priv *sta_priv = (struct wfx_sta_priv *)&sta->drv_priv;
+	struct wfx_vif *wvif = (struct wfx_vif *)vif->drv_priv;
+	struct wfx_dev *wdev = hw->priv;
+	struct sk_buff_head dropped;
+
+	skb_queue_head_init(&dropped);
+	wfx_tx_link_drop(wvif, sta_priv->link_id, &dropped);
+	if (!wdev->chip_frozen &&
+	    !wait_event_timeout(wdev->tx_dequeue,
+				wfx_tx_link_flushed(wvif, sta_priv->link_id),
+				msecs_to_jiffies(1000)))
+		dev_warn(wdev->dev, "cannot flush tx frames of link %d\n",
+			 sta_priv->link_id);
+	wfx_tx_report_dropped(wdev, &dropped);
+}
+#endif
@@ -9,6 +9,7 @@
 #define WFX_DATA_TX_H
 
 #include <linux/list.h>
+#include <linux/hashtable.h>
 #include <net/mac80211.h>
 
 #include "hif_api_cmd.h"
@@ -20,6 +21,8 @@ struct wfx_vif;
 
 struct tx_policy {
 	struct list_head link;
+	struct hlist_node hnode; // Linked in tx_policy_cache->hash if rates set
+	u32 hash;
 	int usage_count;
 	u8 rates[12];
 	bool uploaded;
@@ -27,7 +30,8 @@ struct tx_policy {
 
 struct tx_policy_cache {
 	struct tx_policy cache[HIF_TX_RETRY_POLICY_MAX];
-	// FIXME: use a trees and drop hash from tx_policy
+	// Index of cache by the hash of the rates
+	DECLARE_HASHTABLE(hash, 4);
 	struct list_head used;
 	struct list_head free;
 	spinlock_t lock;
@@ -35,6 +39,10 @@ struct tx_policy_cache {
 
 struct wfx_tx_priv {
 	ktime_t xmit_timestamp;
+	// Lower 32 bits of the deadline in us (0 means no deadline)
+	u32 deadline;
+	// Airtime charged to the link on dequeue (in us)
+	u32 airtime_charged;
 };
 
 void wfx_tx_policy_init(struct wfx_vif *wvif);
@@ -42,9 +50,19 @@ void wfx_tx_policy_upload_work(struct work_struct *work);
 
 void wfx_tx(struct ieee80211_hw *hw, struct ieee80211_tx_control *control,
 	    struct sk_buff *skb);
-void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg);
+void wfx_wake_tx_queue(struct ieee80211_hw *hw, struct ieee80211_txq *txq);
+bool wfx_can_aggregate_in_amsdu(struct ieee80211_hw *hw, struct sk_buff *head,
+				struct sk_buff *skb);
+bool wfx_tx_pull(struct wfx_dev *wdev);
+void wfx_tx_report_expired(struct wfx_dev *wdev, struct sk_buff_head *expired);
+void wfx_tx_confirm_cb(struct wfx_dev *wdev, const struct hif_cnf_tx *arg,
+		       int num);
+void wfx_tx_status_flush(struct wfx_dev *wdev);
+void wfx_tx_status_purge(struct wfx_dev *wdev);
 void wfx_flush(struct ieee80211_hw *hw, struct ieee80211_vif *vif,
 	       u32 queues, bool drop);
+void wfx_flush_sta(struct ieee80211_hw *hw, struct ieee80211_vif *vif,
+		   struct ieee80211_sta *sta);
 
 static inline struct wfx_tx_priv *wfx_skb_tx_priv(struct sk_buff *skb)
 {
@@ -217,6 +217,38 @@ static int wfx_rx_stats_show(struct seq_file *seq, void *v)
 }
 DEFINE_SHOW_ATTRIBUTE(wfx_rx_stats);
 
+static int wfx_rx_pool_show(struct seq_file *seq, void *v)
+{
+	struct wfx_dev *wdev = seq->private;
+	unsigned long hits = wdev->hif.rx_pool_hits;
+	unsigned long misses = wdev->hif.rx_pool_misses;
+
+	seq_printf(seq, "hits:      %lu\n", hits);
+	seq_printf(seq, "misses:    %lu\n", misses);
+	seq_printf(seq, "recycled:  %lu\n", wdev->hif.rx_pool_recycled);
+	seq_printf(seq, "available: %u\n", skb_queue_len(&wdev->hif.rx_pool));
+	seq_printf(seq, "hit rate:  %lu%%\n",
+		   hits + misses ? hits * 100 / (hits + misses) : 0);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wfx_rx_pool);
+
+static int wfx_tx_expired_show(struct seq_file *seq, void *v)
+{
+	static const char * const ac_names[] = { "VO", "VI", "BE", "BK" };
+	struct wfx_dev *wdev = seq->private;
+	int i;
+
+	seq_puts(seq, "     lifetime  driver  firmware\n");
+	for (i = 0; i < IEEE80211_NUM_ACS; i++)
+		seq_printf(seq, "%s:  %6ums  %6d  %8d\n", ac_names[i],
+			   wdev->tx_lifetime[i],
+			   atomic_read(&wdev->tx_expired_drv[i]),
+			   atomic_read(&wdev->tx_expired_fw[i]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wfx_tx_expired);
+
 static int wfx_tx_power_loop_show(struct seq_file *seq, void *v)
 {
 	struct wfx_dev *wdev = seq->private;
@@ -333,6 +365,44 @@ static const struct file_operations wfx_burn_slk_key_fops = {
 	.write = wfx_burn_slk_key_write,
 };
 
+#ifdef CONFIG_WFX_SECURE_LINK
+#define SL_BENCH_NUM_MSGS 10000
+
+// Compare the implementations of AES-CCM usable by secure link
+static int wfx_sl_bench_show(struct seq_file *seq, void *v)
+{
+	static const char * const names[] = { "mbedtls", "kcrypto" };
+	static const size_t lens[] = { 64, 1536 };
+	u64 duration_cycles;
+	s64 duration_ns;
+	int i, j, ret;
+
+	seq_printf(seq, "%d messages encrypted then decrypted\n",
+		   SL_BENCH_NUM_MSGS);
+	seq_puts(seq, "backend  bytes  ns/msg  cycles/msg  MB/s\n");
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		for (j = 0; j < ARRAY_SIZE(lens); j++) {
+			ret = wfx_sl_bench(i, lens[j], SL_BENCH_NUM_MSGS,
+					   &duration_ns, &duration_cycles);
+			if (ret) {
+				seq_printf(seq, "%-7s  %5zu  error %d\n",
+					   names[i], lens[j], ret);
+				continue;
+			}
+			duration_ns = max_t(s64, duration_ns, 1);
+			seq_printf(seq, "%-7s  %5zu  %6lld  %10llu  %4llu\n",
+				   names[i], lens[j],
+				   div_s64(duration_ns, SL_BENCH_NUM_MSGS),
+				   div_u64(duration_cycles, SL_BENCH_NUM_MSGS),
+				   div64_u64((u64)lens[j] * SL_BENCH_NUM_MSGS *
+					     NSEC_PER_USEC, duration_ns));
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wfx_sl_bench);
+#endif
+
 struct dbgfs_hif_msg {
 	struct wfx_dev *wdev;
 	struct completion complete;
@@ -447,16 +517,26 @@ DEFINE_DEBUGFS_ATTRIBUTE(wfx_ps_timeout_fops, wfx_ps_timeout_get, wfx_ps_timeout
 
 int wfx_debug_init(struct wfx_dev *wdev)
 {
-	struct dentry *d;
+	struct dentry *d, *lifetime;
 
 	d = debugfs_create_dir("wfx", wdev->hw->wiphy->debugfsdir);
 	debugfs_create_file("counters", 0444, d, wdev, &wfx_counters_fops);
 	debugfs_create_file("rx_stats", 0444, d, wdev, &wfx_rx_stats_fops);
+	debugfs_create_file("rx_pool", 0444, d, wdev, &wfx_rx_pool_fops);
+	debugfs_create_file("tx_expired", 0444, d, wdev, &wfx_tx_expired_fops);
+	lifetime = debugfs_create_dir("tx_lifetime", d);
+	debugfs_create_u32("vo", 0600, lifetime, &wdev->tx_lifetime[0]);
+	debugfs_create_u32("vi", 0600, lifetime, &wdev->tx_lifetime[1]);
+	debugfs_create_u32("be", 0600, lifetime, &wdev->tx_lifetime[2]);
+	debugfs_create_u32("bk", 0600, lifetime, &wdev->tx_lifetime[3]);
 	debugfs_create_file("tx_power_loop", 0444, d, wdev,
 			    &wfx_tx_power_loop_fops);
 	debugfs_create_file("send_pds", 0200, d, wdev, &wfx_send_pds_fops);
 	debugfs_create_file("burn_slk_key", 0200, d, wdev,
 			    &wfx_burn_slk_key_fops);
+#ifdef CONFIG_WFX_SECURE_LINK
+	debugfs_create_file("sl_bench", 0444, d, wdev, &wfx_sl_bench_fops);
+#endif
 	debugfs_create_file("send_hif_msg", 0600, d, wdev,
 			    &wfx_send_hif_msg_fops);
 	debugfs_create_file("ps_timeout", 0600, d, wdev, &wfx_ps_timeout_fops);
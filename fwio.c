@@ -404,9 +404,12 @@ int wfx_init_device(struct wfx_dev *wdev)
 	ret = config_reg_write_bits(wdev, CFG_CPU_RESET, 0);
 	if (ret < 0)
 		return ret;
-	ret = load_firmware_secure(wdev);
-	if (ret < 0)
-		return ret;
+	// Emulated devices do not run any firmware
+	if (wdev->pdata.file_fw) {
+		ret = load_firmware_secure(wdev);
+		if (ret < 0)
+			return ret;
+	}
 	return config_reg_write_bits(wdev,
 				     CFG_DIRECT_ACCESS_MODE |
 				     CFG_IRQ_ENABLE_DATA |
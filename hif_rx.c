@@ -56,7 +56,7 @@ static int hif_tx_confirm(struct wfx_dev *wdev,
 {
 	const struct hif_cnf_tx *body = buf;
 
-	wfx_tx_confirm_cb(wdev, body);
+	wfx_tx_confirm_cb(wdev, body, 1);
 	return 0;
 }
 
@@ -64,11 +64,9 @@ static int hif_multi_tx_confirm(struct wfx_dev *wdev,
 				const struct hif_msg *hif, const void *buf)
 {
 	const struct hif_cnf_multi_transmit *body = buf;
-	int i;
 
 	WARN(body->num_tx_confs <= 0, "corrupted message");
-	for (i = 0; i < body->num_tx_confs; i++)
-		wfx_tx_confirm_cb(wdev, &body->tx_conf_payload[i]);
+	wfx_tx_confirm_cb(wdev, body->tx_conf_payload, body->num_tx_confs);
 	return 0;
 }
 
@@ -410,5 +408,5 @@ void wfx_handle_rx(struct wfx_dev *wdev, struct sk_buff *skb)
 		dev_err(wdev->dev, "unexpected HIF confirmation: ID %02x\n",
 			hif_id);
 free:
-	dev_kfree_skb(skb);
+	wfx_bh_rx_recycle(wdev, skb);
 }
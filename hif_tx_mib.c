@@ -209,25 +209,30 @@ int hif_set_association_mode(struct wfx_vif *wvif, int ampdu_density,
 			     HIF_MIB_ID_SET_ASSOCIATION_MODE, &arg, sizeof(arg));
 }
 
-int hif_set_tx_rate_retry_policy(struct wfx_vif *wvif,
-				 int policy_index, u8 *rates)
+// rates contains num arrays of 12 bytes
+int hif_set_tx_rate_retry_policy(struct wfx_vif *wvif, const u8 *policy_index,
+				 const u8 *rates, int num)
 {
 	struct hif_mib_set_tx_rate_retry_policy *arg;
-	size_t size = struct_size(arg, tx_rate_retry_policy, 1);
-	int ret;
+	struct hif_tx_rate_retry_policy *policy;
+	size_t size = struct_size(arg, tx_rate_retry_policy, num);
+	int ret, i;
 
 	arg = kzalloc(size, GFP_KERNEL);
 	if (!arg)
 		return -ENOMEM;
-	arg->num_tx_rate_policies = 1;
-	arg->tx_rate_retry_policy[0].policy_index = policy_index;
-	arg->tx_rate_retry_policy[0].short_retry_count = 255;
-	arg->tx_rate_retry_policy[0].long_retry_count = 255;
-	arg->tx_rate_retry_policy[0].first_rate_sel = 1;
-	arg->tx_rate_retry_policy[0].terminate = 1;
-	arg->tx_rate_retry_policy[0].count_init = 1;
-	memcpy(&arg->tx_rate_retry_policy[0].rates, rates,
-	       sizeof(arg->tx_rate_retry_policy[0].rates));
+	arg->num_tx_rate_policies = num;
+	for (i = 0; i < num; i++) {
+		policy = &arg->tx_rate_retry_policy[i];
+		policy->policy_index = policy_index[i];
+		policy->short_retry_count = 255;
+		policy->long_retry_count = 255;
+		policy->first_rate_sel = 1;
+		policy->terminate = 1;
+		policy->count_init = 1;
+		memcpy(&policy->rates, rates + i * sizeof(policy->rates),
+		       sizeof(policy->rates));
+	}
 	ret = hif_write_mib(wvif->wdev, wvif->id,
 			    HIF_MIB_ID_SET_TX_RATE_RETRY_POLICY, arg, size);
 	kfree(arg);
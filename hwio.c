@@ -7,7 +7,6 @@
  */
 #include <linux/kernel.h>
 #include <linux/delay.h>
-#include <linux/slab.h>
 
 #include "hwio.h"
 #include "wfx.h"
@@ -20,25 +19,41 @@
  * About CONFIG_VMAP_STACK:
  * When CONFIG_VMAP_STACK is enabled, it is not possible to run DMA on stack
  * allocated data. Functions below that work with registers (aka functions
- * ending with "32") automatically reallocate buffers with kmalloc. However,
- * functions that work with arbitrary length buffers let's caller to handle
- * memory location. In doubt, enable CONFIG_DEBUG_SG to detect badly located
- * buffer.
+ * ending with "32") use the buffers preallocated in wfx_dev. They must be
+ * called with the bus locked. However, functions that work with arbitrary
+ * length buffers let's caller to handle memory location. In doubt, enable
+ * CONFIG_DEBUG_SG to detect badly located buffer.
  */
 
+/*
+ * Chip sets the error bits of the config register and the host clears them by
+ * writing 0. Record the errors seen by any read of the register, so bh can
+ * report them without reading the register again (see ack_sdio_data()).
+ */
+static void config_reg_track_errors(struct wfx_dev *wdev, int reg, u32 val,
+				    bool write)
+{
+	if (reg != WFX_REG_CONFIG)
+		return;
+	if (write)
+		wdev->config_reg_errors &= val & CFG_ERR_MASK;
+	else
+		wdev->config_reg_errors |= val & CFG_ERR_MASK;
+}
+
 static int read32(struct wfx_dev *wdev, int reg, u32 *val)
 {
 	int ret;
-	__le32 *tmp = kmalloc(sizeof(u32), GFP_KERNEL);
+	__le32 *tmp = wdev->io_reg_buf;
 
-	*val = ~0; // Never return undefined value
-	if (!tmp)
-		return -ENOMEM;
 	ret = wdev->hwbus_ops->copy_from_io(wdev->hwbus_priv, reg, tmp,
 					    sizeof(u32));
 	if (ret >= 0)
 		*val = le32_to_cpu(*tmp);
-	kfree(tmp);
+	else
+		*val = ~0; // Never return undefined value
+	if (!ret)
+		config_reg_track_errors(wdev, reg, *val, false);
 	if (ret)
 		dev_err(wdev->dev, "%s: bus communication error: %d\n",
 			__func__, ret);
@@ -48,14 +63,13 @@ static int read32(struct wfx_dev *wdev, int reg, u32 *val)
 static int write32(struct wfx_dev *wdev, int reg, u32 val)
 {
 	int ret;
-	__le32 *tmp = kmalloc(sizeof(u32), GFP_KERNEL);
+	__le32 *tmp = wdev->io_reg_buf;
 
-	if (!tmp)
-		return -ENOMEM;
 	*tmp = cpu_to_le32(val);
 	ret = wdev->hwbus_ops->copy_to_io(wdev->hwbus_priv, reg, tmp,
 					  sizeof(u32));
-	kfree(tmp);
+	if (!ret)
+		config_reg_track_errors(wdev, reg, val, true);
 	if (ret)
 		dev_err(wdev->dev, "%s: bus communication error: %d\n",
 			__func__, ret);
@@ -199,16 +213,13 @@ static int indirect_read32_locked(struct wfx_dev *wdev, int reg,
 				  u32 addr, u32 *val)
 {
 	int ret;
-	__le32 *tmp = kmalloc(sizeof(u32), GFP_KERNEL);
+	__le32 *tmp = wdev->io_ind_buf;
 
-	if (!tmp)
-		return -ENOMEM;
 	wdev->hwbus_ops->lock(wdev->hwbus_priv);
 	ret = indirect_read(wdev, reg, addr, tmp, sizeof(u32));
 	*val = le32_to_cpu(*tmp);
 	_trace_io_ind_read32(reg, addr, *val);
 	wdev->hwbus_ops->unlock(wdev->hwbus_priv);
-	kfree(tmp);
 	return ret;
 }
 
@@ -216,16 +227,13 @@ static int indirect_write32_locked(struct wfx_dev *wdev, int reg,
 				   u32 addr, u32 val)
 {
 	int ret;
-	__le32 *tmp = kmalloc(sizeof(u32), GFP_KERNEL);
+	__le32 *tmp = wdev->io_ind_buf;
 
-	if (!tmp)
-		return -ENOMEM;
-	*tmp = cpu_to_le32(val);
 	wdev->hwbus_ops->lock(wdev->hwbus_priv);
+	*tmp = cpu_to_le32(val);
 	ret = indirect_write(wdev, reg, addr, tmp, sizeof(u32));
 	_trace_io_ind_write32(reg, addr, val);
 	wdev->hwbus_ops->unlock(wdev->hwbus_priv);
-	kfree(tmp);
 	return ret;
 }
 
@@ -261,6 +269,72 @@ int wfx_data_write(struct wfx_dev *wdev, const void *buf, size_t len)
 	return ret;
 }
 
+/*
+ * Return the number of messages written. The messages after the first failure
+ * are not sent. A negative error is returned if no message was written.
+ */
+int wfx_data_write_multi(struct wfx_dev *wdev, void * const *bufs,
+			 const size_t *lens, int num)
+{
+	int ret = 0;
+	int done = 0;
+	int i;
+
+	WARN(num > WFX_BUS_MAX_BATCH, "%s: too many buffers", __func__);
+	for (i = 0; i < num; i++)
+		WARN((long)bufs[i] & 3, "%s: unaligned buffer", __func__);
+	wdev->hwbus_ops->lock(wdev->hwbus_priv);
+	if (wdev->hwbus_ops->copy_to_io_multi) {
+		ret = wdev->hwbus_ops->copy_to_io_multi(wdev->hwbus_priv,
+							WFX_REG_IN_OUT_QUEUE,
+							bufs, lens, num);
+		if (!ret)
+			done = num;
+	} else {
+		for (done = 0; done < num; done++) {
+			ret = wdev->hwbus_ops->copy_to_io(wdev->hwbus_priv,
+							  WFX_REG_IN_OUT_QUEUE,
+							  bufs[done],
+							  lens[done]);
+			if (ret)
+				break;
+		}
+	}
+	for (i = 0; i < done; i++)
+		_trace_io_write(WFX_REG_IN_OUT_QUEUE, bufs[i], lens[i]);
+	wdev->hwbus_ops->unlock(wdev->hwbus_priv);
+	if (ret)
+		dev_err(wdev->dev, "%s: bus communication error after %d/%d messages: %d\n",
+			__func__, done, num, ret);
+	return done ? done : ret;
+}
+
+/*
+ * Buffers must stay valid until the bus calls wfx_bh_tx_done(). Caller has to
+ * check copy_to_io_async is available.
+ */
+int wfx_data_write_async(struct wfx_dev *wdev, void * const *bufs,
+			 const size_t *lens, int num, void *cookie)
+{
+	int ret;
+	int i;
+
+	WARN(num > WFX_BUS_MAX_BATCH, "%s: too many buffers", __func__);
+	for (i = 0; i < num; i++)
+		WARN((long)bufs[i] & 3, "%s: unaligned buffer", __func__);
+	wdev->hwbus_ops->lock(wdev->hwbus_priv);
+	ret = wdev->hwbus_ops->copy_to_io_async(wdev->hwbus_priv,
+						WFX_REG_IN_OUT_QUEUE,
+						bufs, lens, num, cookie);
+	for (i = 0; i < num; i++)
+		_trace_io_write(WFX_REG_IN_OUT_QUEUE, bufs[i], lens[i]);
+	wdev->hwbus_ops->unlock(wdev->hwbus_priv);
+	if (ret)
+		dev_err(wdev->dev, "%s: bus communication error: %d\n",
+			__func__, ret);
+	return ret;
+}
+
 int sram_buf_read(struct wfx_dev *wdev, u32 addr, void *buf, size_t len)
 {
 	return indirect_read_locked(wdev, WFX_REG_SRAM_DPORT, addr, buf, len);
@@ -316,6 +390,17 @@ int config_reg_write_bits(struct wfx_dev *wdev, u32 mask, u32 val)
 	return write32_bits_locked(wdev, WFX_REG_CONFIG, mask, val);
 }
 
+// Return the errors seen by the last accesses to the config register
+u32 config_reg_get_errors(struct wfx_dev *wdev)
+{
+	u32 val;
+
+	wdev->hwbus_ops->lock(wdev->hwbus_priv);
+	val = wdev->config_reg_errors;
+	wdev->hwbus_ops->unlock(wdev->hwbus_priv);
+	return val;
+}
+
 int control_reg_read(struct wfx_dev *wdev, u32 *val)
 {
 	return read32_locked(wdev, WFX_REG_CONTROL, val);
@@ -14,6 +14,10 @@ struct wfx_dev;
 
 int wfx_data_read(struct wfx_dev *wdev, void *buf, size_t buf_len);
 int wfx_data_write(struct wfx_dev *wdev, const void *buf, size_t buf_len);
+int wfx_data_write_multi(struct wfx_dev *wdev, void * const *bufs,
+			 const size_t *buf_lens, int num);
+int wfx_data_write_async(struct wfx_dev *wdev, void * const *bufs,
+			 const size_t *buf_lens, int num, void *cookie);
 
 int sram_buf_read(struct wfx_dev *wdev, u32 addr, void *buf, size_t len);
 int sram_buf_write(struct wfx_dev *wdev, u32 addr, const void *buf, size_t len);
@@ -37,6 +41,7 @@ int ahb_reg_write(struct wfx_dev *wdev, u32 addr, u32 val);
 #define CFG_ERR_HOST_NO_IN_QUEUE   0x00000040
 #define CFG_ERR_HOST_CRC_MISS      0x00000080 // only with SDIO
 #define CFG_SPI_IGNORE_CS          0x00000080 // only with SPI
+#define CFG_ERR_MASK               0x000000FF // Driver never sets IGNORE_CS
 #define CFG_BYTE_ORDER_MASK        0x00000300 // only writable with SPI
 #define     CFG_BYTE_ORDER_BADC    0x00000000
 #define     CFG_BYTE_ORDER_DCBA    0x00000100
@@ -58,6 +63,7 @@ int ahb_reg_write(struct wfx_dev *wdev, u32 addr, u32 val);
 int config_reg_read(struct wfx_dev *wdev, u32 *val);
 int config_reg_write(struct wfx_dev *wdev, u32 val);
 int config_reg_write_bits(struct wfx_dev *wdev, u32 mask, u32 val);
+u32 config_reg_get_errors(struct wfx_dev *wdev);
 
 #define CTRL_NEXT_LEN_MASK   0x00000FFF
 #define CTRL_WLAN_WAKEUP     0x00001000
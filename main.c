@@ -133,6 +133,10 @@ static const struct ieee80211_ops wfx_ops = {
 	.remove_interface	= wfx_remove_interface,
 	.config                 = wfx_config,
 	.tx			= wfx_tx,
+#if (KERNEL_VERSION(5, 5, 0) <= LINUX_VERSION_CODE)
+	.wake_tx_queue		= wfx_wake_tx_queue,
+	.can_aggregate_in_amsdu	= wfx_can_aggregate_in_amsdu,
+#endif
 	.join_ibss		= wfx_join_ibss,
 	.leave_ibss		= wfx_leave_ibss,
 	.conf_tx		= wfx_conf_tx,
@@ -150,6 +154,9 @@ static const struct ieee80211_ops wfx_ops = {
 	.configure_filter	= wfx_configure_filter,
 	.ampdu_action		= wfx_ampdu_action,
 	.flush			= wfx_flush,
+#if (KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE)
+	.flush_sta		= wfx_flush_sta,
+#endif
 	.add_chanctx		= wfx_add_chanctx,
 	.remove_chanctx		= wfx_remove_chanctx,
 	.change_chanctx		= wfx_change_chanctx,
@@ -223,6 +230,8 @@ static int wfx_send_pdata_pds(struct wfx_dev *wdev)
 	const struct firmware *pds;
 	u8 *tmp_buf;
 
+	if (!wdev->pdata.file_pds)
+		return 0;
 	ret = request_firmware(&pds, wdev->pdata.file_pds, wdev->dev);
 	if (ret) {
 		dev_err(wdev->dev, "can't load PDS file %s\n",
@@ -243,6 +252,8 @@ static void wfx_free_common(void *data)
 	mutex_destroy(&wdev->tx_power_loop_info_lock);
 	mutex_destroy(&wdev->rx_stats_lock);
 	mutex_destroy(&wdev->conf_mutex);
+	kfree(wdev->io_ind_buf);
+	kfree(wdev->io_reg_buf);
 	ieee80211_free_hw(wdev->hw);
 }
 
@@ -271,6 +282,11 @@ struct wfx_dev *wfx_init_common(struct device *dev,
 #if (KERNEL_VERSION(3, 19, 0) > LINUX_VERSION_CODE)
 	ieee80211_hw_set(hw, SUPPORTS_UAPSD);
 #endif
+#if (KERNEL_VERSION(5, 5, 0) <= LINUX_VERSION_CODE)
+	// mac80211 only builds A-MSDUs from TXQs. Since TX_FRAG_LIST is not
+	// set, it linearizes them before wfx_tx_pull() gets them.
+	ieee80211_hw_set(hw, TX_AMSDU);
+#endif
 
 	hw->vif_data_size = sizeof(struct wfx_vif);
 	hw->sta_data_size = sizeof(struct wfx_sta_priv);
@@ -292,6 +308,10 @@ struct wfx_dev *wfx_init_common(struct device *dev,
 					NL80211_PROBE_RESP_OFFLOAD_SUPPORT_P2P |
 					NL80211_PROBE_RESP_OFFLOAD_SUPPORT_80211U;
 	hw->wiphy->features |= NL80211_FEATURE_AP_SCAN;
+#if (KERNEL_VERSION(5, 5, 0) <= LINUX_VERSION_CODE)
+	// Airtime is reported in tx_info->status.tx_time
+	wiphy_ext_feature_set(hw->wiphy, NL80211_EXT_FEATURE_AIRTIME_FAIRNESS);
+#endif
 	hw->wiphy->flags |= WIPHY_FLAG_AP_PROBE_RESP_OFFLOAD;
 	hw->wiphy->flags |= WIPHY_FLAG_AP_UAPSD;
 	hw->wiphy->max_ap_assoc_sta = HIF_LINK_ID_MAX;
@@ -329,10 +349,21 @@ struct wfx_dev *wfx_init_common(struct device *dev,
 	INIT_DELAYED_WORK(&wdev->cooling_timeout_work,
 			  wfx_cooling_timeout_work);
 	skb_queue_head_init(&wdev->tx_pending);
+	skb_queue_head_init(&wdev->tx_status);
 	init_waitqueue_head(&wdev->tx_dequeue);
+	wfx_tx_limits_init(wdev);
 	wfx_init_hif_cmd(&wdev->hif_cmd);
 	wdev->force_ps_timeout = -1;
 
+	// Register accesses may use DMA. Buffers returned by kmalloc() are
+	// DMA-safe while a field of struct wfx_dev is not.
+	wdev->io_reg_buf = kmalloc(sizeof(*wdev->io_reg_buf), GFP_KERNEL);
+	wdev->io_ind_buf = kmalloc(sizeof(*wdev->io_ind_buf), GFP_KERNEL);
+	if (!wdev->io_reg_buf || !wdev->io_ind_buf) {
+		wfx_free_common(wdev);
+		return NULL;
+	}
+
 	if (devm_add_action_or_reset(dev, wfx_free_common, wdev))
 		return NULL;
 
@@ -352,7 +383,9 @@ int wfx_probe(struct wfx_dev *wdev)
 	wdev->pdata.gpio_wakeup = NULL;
 	wdev->poll_irq = true;
 
-	wfx_bh_register(wdev);
+	err = wfx_bh_register(wdev);
+	if (err)
+		return err;
 
 	err = wfx_init_device(wdev);
 	if (err)
@@ -466,6 +499,7 @@ err1:
 	wdev->hwbus_ops->irq_unsubscribe(wdev->hwbus_priv);
 err0:
 	wfx_bh_unregister(wdev);
+	wfx_sl_deinit(wdev);
 	return err;
 }
 
@@ -475,6 +509,7 @@ void wfx_release(struct wfx_dev *wdev)
 	hif_shutdown(wdev);
 	wdev->hwbus_ops->irq_unsubscribe(wdev->hwbus_priv);
 	wfx_bh_unregister(wdev);
+	wfx_tx_status_purge(wdev);
 	wfx_sl_deinit(wdev);
 }
 
@@ -488,12 +523,15 @@ static int __init wfx_core_init(void)
 		ret = spi_register_driver(&wfx_spi_driver);
 	if (IS_ENABLED(CONFIG_MMC) && !ret)
 		ret = sdio_register_driver(&wfx_sdio_driver);
+	if (!ret)
+		ret = wfx_emul_register();
 	return ret;
 }
 module_init(wfx_core_init);
 
 static void __exit wfx_core_exit(void)
 {
+	wfx_emul_unregister();
 	if (IS_ENABLED(CONFIG_MMC))
 		sdio_unregister_driver(&wfx_sdio_driver);
 	if (IS_ENABLED(CONFIG_SPI))
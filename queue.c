@@ -65,56 +65,313 @@ void wfx_tx_lock_flush(struct wfx_dev *wdev)
 	wfx_tx_flush(wdev);
 }
 
+/*
+ * The firmware queues all the frames it receives, so without any limit, the
+ * latency of the frames grows with the load. The number of bytes that each AC
+ * may have in flight (in the driver queues and in the firmware) is adjusted
+ * from the time the frames waited in the firmware (tx_queue_delay): the limit
+ * is reduced by 1/4 (at most once per target delay) when the delay exceeds the
+ * target and it grows by one frame when the limit is reached while the delay
+ * is low.
+ */
+#define WFX_TX_LIMIT_MIN	(2 * 1600)
+#define WFX_TX_LIMIT_MAX	(256 * 1024)
+#define WFX_TX_LIMIT_DEFAULT	(32 * 1024)
+
+// Target of tx_queue_delay for each AC (in us)
+static const unsigned int wfx_tx_limit_targets[IEEE80211_NUM_ACS] = {
+	2000, 4000, 10000, 20000
+};
+
+void wfx_tx_limits_init(struct wfx_dev *wdev)
+{
+	int i;
+
+	for (i = 0; i < IEEE80211_NUM_ACS; i++) {
+		spin_lock_init(&wdev->tx_limit[i].lock);
+		wdev->tx_limit[i].limit = WFX_TX_LIMIT_DEFAULT;
+	}
+}
+
+void wfx_tx_limit_queued(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	int ac = skb_get_queue_mapping(skb);
+	struct wfx_tx_limit *txl = &wdev->tx_limit[ac];
+
+	spin_lock_bh(&txl->lock);
+	txl->inflight += skb->len;
+	if (txl->inflight >= txl->limit) {
+		ieee80211_stop_queue(wdev->hw, ac);
+		txl->stopped = true;
+	}
+	spin_unlock_bh(&txl->lock);
+}
+
+void wfx_tx_limit_completed(struct wfx_dev *wdev, int ac, int len)
+{
+	struct wfx_tx_limit *txl = &wdev->tx_limit[ac];
+
+	spin_lock_bh(&txl->lock);
+	txl->inflight -= len;
+	WARN_ON(txl->inflight < 0);
+	if (txl->stopped && txl->inflight < txl->limit) {
+		// Else, wfx_tx_limit_wake_queues() will wake it
+		if (!READ_ONCE(wdev->tx_policy_full))
+			ieee80211_wake_queue(wdev->hw, ac);
+		txl->stopped = false;
+	}
+	spin_unlock_bh(&txl->lock);
+}
+
+/*
+ * mac80211 provides only one stop reason to the drivers, but the queues are
+ * stopped by the tx limits and by the tx policy caches (see
+ * wfx_tx_policy_get()). Once the caches have free entries again, only wake
+ * the ACs that are not over their limit.
+ *
+ * Caller has to clear its bit of tx_policy_full first. Since tx_policy_full is
+ * checked under txl->lock, one of this function or wfx_tx_limit_completed()
+ * sees the other's update.
+ */
+void wfx_tx_limit_wake_queues(struct wfx_dev *wdev)
+{
+	struct wfx_tx_limit *txl;
+	int i;
+
+	for (i = 0; i < IEEE80211_NUM_ACS; i++) {
+		txl = &wdev->tx_limit[i];
+		spin_lock_bh(&txl->lock);
+		if (!txl->stopped && !READ_ONCE(wdev->tx_policy_full))
+			ieee80211_wake_queue(wdev->hw, i);
+		spin_unlock_bh(&txl->lock);
+	}
+}
+
+void wfx_tx_limit_update(struct wfx_dev *wdev, int ac, unsigned int delay_us)
+{
+	struct wfx_tx_limit *txl = &wdev->tx_limit[ac];
+	unsigned int target = wfx_tx_limit_targets[ac];
+	ktime_t now = ktime_get();
+
+	spin_lock_bh(&txl->lock);
+	if (delay_us > target) {
+		if (ktime_us_delta(now, txl->last_decrease) > target) {
+			txl->limit -= txl->limit / 4;
+			txl->limit = max(txl->limit, WFX_TX_LIMIT_MIN);
+			txl->last_decrease = now;
+		}
+	} else if (delay_us < target / 2 && txl->stopped) {
+		txl->limit += 1600;
+		txl->limit = min(txl->limit, WFX_TX_LIMIT_MAX);
+	}
+	spin_unlock_bh(&txl->lock);
+}
+
 void wfx_tx_queues_init(struct wfx_vif *wvif)
 {
 	// The device is in charge to respect the details of the QoS parameters.
 	// The driver just ensure that it roughtly respect the priorities to
 	// avoid any shortage.
 	const int priorities[IEEE80211_NUM_ACS] = { 1, 2, 64, 128 };
-	int i;
+	struct wfx_queue *queue;
+	int i, j;
 
 	for (i = 0; i < IEEE80211_NUM_ACS; ++i) {
-		skb_queue_head_init(&wvif->tx_queue[i].normal);
-		skb_queue_head_init(&wvif->tx_queue[i].cab);
-		wvif->tx_queue[i].priority = priorities[i];
+		queue = &wvif->tx_queue[i];
+		spin_lock_init(&queue->lock);
+		INIT_LIST_HEAD(&queue->active);
+		init_llist_head(&queue->incoming);
+		for (j = 0; j < ARRAY_SIZE(queue->links); j++) {
+			__skb_queue_head_init(&queue->links[j].skbs);
+			INIT_LIST_HEAD(&queue->links[j].list);
+			atomic_set(&queue->links[j].pending_frames, 0);
+			queue->links[j].deficit = WFX_AIRTIME_QUANTUM;
+			queue->links[j].airtime_avg = WFX_AIRTIME_DEFAULT;
+		}
+		skb_queue_head_init(&queue->cab);
+		atomic_set(&queue->weight, 0);
+		queue->priority = priorities[i];
 	}
 }
 
+// Index of the queue in wdev->tx_queues_map and wdev->tx_cab_map
+static int wfx_tx_queue_bit(struct wfx_vif *wvif, struct wfx_queue *queue)
+{
+	return wvif->id * IEEE80211_NUM_ACS + (queue - wvif->tx_queue);
+}
+
+// Bits of the queues of wvif
+static unsigned long wfx_tx_queues_mask(struct wfx_vif *wvif)
+{
+	return GENMASK(IEEE80211_NUM_ACS - 1, 0) << (wvif->id * IEEE80211_NUM_ACS);
+}
+
+static struct wfx_queue *wfx_tx_queue_from_bit(struct wfx_dev *wdev, int bit)
+{
+	struct wfx_vif *wvif = wdev_to_wvif(wdev, bit / IEEE80211_NUM_ACS);
+
+	if (WARN_ON(!wvif))
+		return NULL;
+	return &wvif->tx_queue[bit % IEEE80211_NUM_ACS];
+}
+
 void wfx_tx_queues_check_empty(struct wfx_vif *wvif)
 {
 	int i;
 
 	for (i = 0; i < IEEE80211_NUM_ACS; ++i) {
 		WARN_ON(atomic_read(&wvif->tx_queue[i].pending_frames));
-		WARN_ON(!skb_queue_empty_lockless(&wvif->tx_queue[i].normal));
+		WARN_ON(!list_empty_careful(&wvif->tx_queue[i].active));
+		WARN_ON(!llist_empty(&wvif->tx_queue[i].incoming));
 		WARN_ON(!skb_queue_empty_lockless(&wvif->tx_queue[i].cab));
 	}
 }
 
 bool wfx_tx_queue_empty(struct wfx_vif *wvif, struct wfx_queue *queue)
 {
-	return skb_queue_empty(&queue->normal) && skb_queue_empty(&queue->cab);
+	return list_empty_careful(&queue->active) &&
+	       llist_empty(&queue->incoming) &&
+	       skb_queue_empty(&queue->cab);
 }
 
-static void __wfx_tx_queue_drop(struct wfx_vif *wvif,
-				struct sk_buff_head *skb_queue,
-				struct sk_buff_head *dropped)
+// True if the queues of wvif selected in mask have no more frames (in the
+// driver and in the firmware)
+bool wfx_tx_queues_flushed(struct wfx_vif *wvif, u32 mask)
 {
-	struct sk_buff *skb, *tmp;
+	struct wfx_queue *queue;
+	int i;
 
-	spin_lock_bh(&skb_queue->lock);
-	skb_queue_walk_safe(skb_queue, skb, tmp) {
-		__skb_unlink(skb, skb_queue);
-		skb_queue_head(dropped, skb);
+	for (i = 0; i < IEEE80211_NUM_ACS; i++) {
+		if (!(BIT(i) & mask))
+			continue;
+		queue = &wvif->tx_queue[i];
+		if (!wfx_tx_queue_empty(wvif, queue) ||
+		    atomic_read(&queue->pending_frames))
+			return false;
 	}
-	spin_unlock_bh(&skb_queue->lock);
+	return true;
+}
+
+// Same than wfx_tx_queues_flushed() for the frames of one link
+bool wfx_tx_link_flushed(struct wfx_vif *wvif, int link_id)
+{
+	struct wfx_link_queue *link;
+	int i;
+
+	for (i = 0; i < IEEE80211_NUM_ACS; i++) {
+		link = &wvif->tx_queue[i].links[link_id];
+		// Frames of incoming are not sorted by link yet
+		if (!llist_empty(&wvif->tx_queue[i].incoming) ||
+		    !skb_queue_empty_lockless(&link->skbs) ||
+		    atomic_read(&link->pending_frames))
+			return false;
+	}
+	return true;
+}
+
+// Only used for statistics, so locking is not necessary. Frames not yet moved
+// from incoming are not counted.
+int wfx_tx_queue_len(const struct wfx_queue *queue)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(queue->links); i++)
+		len += skb_queue_len(&queue->links[i].skbs);
+	return len;
+}
+
+static struct wfx_link_queue *wfx_tx_queue_get_link(struct wfx_queue *queue,
+						    struct sk_buff *skb)
+{
+	int link_id = wfx_skb_txreq(skb)->peer_sta_id;
+
+	if (WARN_ON(link_id >= ARRAY_SIZE(queue->links)))
+		link_id = 0;
+	return &queue->links[link_id];
+}
+
+/*
+ * Frames are pushed in queue->incoming without any lock (wfx_tx() may run on
+ * any CPU). The bh moves them to the link queues in batches. Must be called
+ * with queue->lock held.
+ */
+static void __wfx_tx_queue_splice(struct wfx_queue *queue)
+{
+	struct llist_node *node = llist_del_all(&queue->incoming);
+	struct wfx_link_queue *link;
+	struct sk_buff *skb;
+
+	// llist is LIFO
+	node = llist_reverse_order(node);
+	while (node) {
+		skb = container_of((struct sk_buff **)node, struct sk_buff, next);
+		node = node->next;
+		skb->next = NULL;
+		link = wfx_tx_queue_get_link(queue, skb);
+		__skb_queue_tail(&link->skbs, skb);
+		if (list_empty(&link->list))
+			list_add_tail(&link->list, &queue->active);
+	}
+}
+
+// Must be called with queue->lock held
+static void __wfx_tx_queue_update_map(struct wfx_vif *wvif,
+				      struct wfx_queue *queue)
+{
+	int bit = wfx_tx_queue_bit(wvif, queue);
+
+	if (!list_empty(&queue->active))
+		return;
+	clear_bit(bit, &wvif->wdev->tx_queues_map);
+	// Pairs with llist_add() in wfx_tx_queues_put()
+	smp_mb__after_atomic();
+	if (!llist_empty(&queue->incoming))
+		set_bit(bit, &wvif->wdev->tx_queues_map);
 }
 
 void wfx_tx_queue_drop(struct wfx_vif *wvif, struct wfx_queue *queue,
 		       struct sk_buff_head *dropped)
 {
-	__wfx_tx_queue_drop(wvif, &queue->cab, dropped);
-	__wfx_tx_queue_drop(wvif, &queue->normal, dropped);
+	int bit = wfx_tx_queue_bit(wvif, queue);
+	struct wfx_link_queue *link, *tmp;
+	struct sk_buff *skb;
+
+	spin_lock_bh(&queue->cab.lock);
+	while ((skb = __skb_dequeue_tail(&queue->cab)) != NULL)
+		skb_queue_head(dropped, skb);
+	clear_bit(bit, &wvif->wdev->tx_cab_map);
+	spin_unlock_bh(&queue->cab.lock);
+	spin_lock_bh(&queue->lock);
+	__wfx_tx_queue_splice(queue);
+	list_for_each_entry_safe(link, tmp, &queue->active, list) {
+		while ((skb = __skb_dequeue_tail(&link->skbs)) != NULL)
+			skb_queue_head(dropped, skb);
+		list_del_init(&link->list);
+	}
+	__wfx_tx_queue_update_map(wvif, queue);
+	spin_unlock_bh(&queue->lock);
+	wake_up(&wvif->wdev->tx_dequeue);
+}
+
+void wfx_tx_link_drop(struct wfx_vif *wvif, int link_id,
+		      struct sk_buff_head *dropped)
+{
+	struct wfx_link_queue *link;
+	struct wfx_queue *queue;
+	struct sk_buff *skb;
+	int i;
+
+	for (i = 0; i < IEEE80211_NUM_ACS; i++) {
+		queue = &wvif->tx_queue[i];
+		link = &queue->links[link_id];
+		spin_lock_bh(&queue->lock);
+		__wfx_tx_queue_splice(queue);
+		while ((skb = __skb_dequeue_tail(&link->skbs)) != NULL)
+			skb_queue_head(dropped, skb);
+		list_del_init(&link->list);
+		__wfx_tx_queue_update_map(wvif, queue);
+		spin_unlock_bh(&queue->lock);
+	}
 	wake_up(&wvif->wdev->tx_dequeue);
 }
 
@@ -122,63 +379,244 @@ void wfx_tx_queues_put(struct wfx_vif *wvif, struct sk_buff *skb)
 {
 	struct wfx_queue *queue = &wvif->tx_queue[skb_get_queue_mapping(skb)];
 	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	int bit = wfx_tx_queue_bit(wvif, queue);
+
+	if (tx_info->flags & IEEE80211_TX_CTL_SEND_AFTER_DTIM) {
+		spin_lock_bh(&queue->cab.lock);
+		__skb_queue_tail(&queue->cab, skb);
+		set_bit(bit, &wvif->wdev->tx_cab_map);
+		spin_unlock_bh(&queue->cab.lock);
+		return;
+	}
+	// skb->next is used as llist_node (see __wfx_tx_queue_splice())
+	llist_add((struct llist_node *)&skb->next, &queue->incoming);
+	set_bit(bit, &wvif->wdev->tx_queues_map);
+}
+
+/*
+ * Links of a queue are served using a deficit round robin weighted by the
+ * airtime consumed by their frames (as reported by the firmware in
+ * hif_cnf_tx). Thus, a slow station cannot starve the others.
+ *
+ * The confirmation comes long after the frame left the queue. So, the average
+ * airtime of the link is charged on dequeue and the difference with the actual
+ * airtime is charged on confirmation (see wfx_tx_queue_charge_airtime()). As
+ * usual with DRR, a link does not keep its deficit once it has no more frames.
+ */
+static struct sk_buff *wfx_tx_queue_dequeue(struct wfx_vif *wvif,
+					    struct wfx_queue *queue)
+{
+	struct wfx_link_queue *link;
+	struct sk_buff *skb = NULL;
+
+	spin_lock_bh(&queue->lock);
+	__wfx_tx_queue_splice(queue);
+	while (!list_empty(&queue->active)) {
+		link = list_first_entry(&queue->active,
+					struct wfx_link_queue, list);
+		if (link->deficit <= 0) {
+			link->deficit += WFX_AIRTIME_QUANTUM;
+			list_move_tail(&link->list, &queue->active);
+			continue;
+		}
+		skb = __skb_dequeue(&link->skbs);
+		wfx_skb_tx_priv(skb)->airtime_charged = link->airtime_avg;
+		link->deficit -= link->airtime_avg;
+		if (skb_queue_empty(&link->skbs)) {
+			list_del_init(&link->list);
+			link->deficit = 0;
+		}
+		break;
+	}
+	__wfx_tx_queue_update_map(wvif, queue);
+	spin_unlock_bh(&queue->lock);
+	return skb;
+}
+
+static struct sk_buff *wfx_tx_queue_dequeue_cab(struct wfx_vif *wvif,
+						struct wfx_queue *queue)
+{
+	struct sk_buff *skb;
+
+	spin_lock_bh(&queue->cab.lock);
+	skb = __skb_dequeue(&queue->cab);
+	if (skb_queue_empty(&queue->cab))
+		clear_bit(wfx_tx_queue_bit(wvif, queue),
+			  &wvif->wdev->tx_cab_map);
+	spin_unlock_bh(&queue->cab.lock);
+	return skb;
+}
+
+// Weight of the queues are updated each time pending_frames change
+static void wfx_tx_queue_inc_pending(struct wfx_queue *queue,
+				     struct sk_buff *skb)
+{
+	atomic_inc(&wfx_tx_queue_get_link(queue, skb)->pending_frames);
+	atomic_inc(&queue->pending_frames);
+	atomic_add(queue->priority, &queue->weight);
+}
+
+// Return true if the queue or the link of skb has no more pending frames
+static bool wfx_tx_queue_dec_pending(struct wfx_queue *queue,
+				     struct sk_buff *skb)
+{
+	struct wfx_link_queue *link = wfx_tx_queue_get_link(queue, skb);
+	bool link_idle, queue_idle;
+
+	link_idle = atomic_dec_and_test(&link->pending_frames);
+	atomic_sub(queue->priority, &queue->weight);
+	queue_idle = atomic_dec_and_test(&queue->pending_frames);
+	return link_idle || queue_idle;
+}
+
+void wfx_tx_queue_charge_airtime(struct wfx_vif *wvif, struct sk_buff *skb,
+				 unsigned int airtime)
+{
+	struct wfx_queue *queue = &wvif->tx_queue[skb_get_queue_mapping(skb)];
+	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	struct wfx_link_queue *link;
 
 	if (tx_info->flags & IEEE80211_TX_CTL_SEND_AFTER_DTIM)
-		skb_queue_tail(&queue->cab, skb);
+		return;
+	link = wfx_tx_queue_get_link(queue, skb);
+	spin_lock_bh(&queue->lock);
+	link->deficit -= airtime;
+	link->deficit += wfx_skb_tx_priv(skb)->airtime_charged;
+	if (airtime)
+		link->airtime_avg = (link->airtime_avg * 7 + airtime) / 8;
+	spin_unlock_bh(&queue->lock);
+}
+
+/*
+ * Frames sent to the chip are indexed by the low bits of their packet_id. Since
+ * these bits come from a counter, two pending frames rarely share the same
+ * slot. When it happens, the newest frame is not indexed and it is found by
+ * walking tx_pending. It takes the slot once the indexed frame is released.
+ */
+static int wfx_pending_slot(u32 packet_id)
+{
+	return packet_id & (WFX_PENDING_SLOTS - 1);
+}
+
+static void wfx_pending_put(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	struct hif_req_tx *req = wfx_skb_txreq(skb);
+	struct sk_buff **slot;
+
+	slot = &wdev->tx_pending_slots[wfx_pending_slot(req->packet_id)];
+	spin_lock_bh(&wdev->tx_pending.lock);
+	__skb_queue_tail(&wdev->tx_pending, skb);
+	if (!*slot)
+		*slot = skb;
 	else
-		skb_queue_tail(&queue->normal, skb);
+		wdev->tx_pending_unindexed++;
+	spin_unlock_bh(&wdev->tx_pending.lock);
 }
 
-void wfx_pending_drop(struct wfx_dev *wdev, struct sk_buff_head *dropped)
+// Return true if waiters of tx_dequeue have to be woken up
+static bool __wfx_pending_release(struct wfx_dev *wdev, struct sk_buff *skb)
 {
+	struct hif_msg *hif = (struct hif_msg *)skb->data;
 	struct wfx_queue *queue;
 	struct wfx_vif *wvif;
-	struct hif_msg *hif;
+
+	wvif = wdev_to_wvif(wdev, hif->interface);
+	if (!wvif)
+		return false;
+	queue = &wvif->tx_queue[skb_get_queue_mapping(skb)];
+	WARN_ON(skb_get_queue_mapping(skb) > 3);
+	WARN_ON(!atomic_read(&queue->pending_frames));
+	return wfx_tx_queue_dec_pending(queue, skb);
+}
+
+static void wfx_pending_release(struct wfx_dev *wdev, struct sk_buff *skb)
+{
+	// Wake up wfx_flush() and wfx_flush_sta()
+	if (__wfx_pending_release(wdev, skb))
+		wake_up(&wdev->tx_dequeue);
+}
+
+void wfx_pending_drop(struct wfx_dev *wdev, struct sk_buff_head *dropped)
+{
 	struct sk_buff *skb;
 
 	WARN(!wdev->chip_frozen, "%s should only be used to recover a frozen device",
 	     __func__);
+	spin_lock_bh(&wdev->tx_pending.lock);
+	memset(wdev->tx_pending_slots, 0, sizeof(wdev->tx_pending_slots));
+	wdev->tx_pending_unindexed = 0;
+	spin_unlock_bh(&wdev->tx_pending.lock);
 	while ((skb = skb_dequeue(&wdev->tx_pending)) != NULL) {
-		hif = (struct hif_msg *)skb->data;
-		wvif = wdev_to_wvif(wdev, hif->interface);
-		if (wvif) {
-			queue = &wvif->tx_queue[skb_get_queue_mapping(skb)];
-			WARN_ON(skb_get_queue_mapping(skb) > 3);
-			WARN_ON(!atomic_read(&queue->pending_frames));
-			atomic_dec(&queue->pending_frames);
-		}
+		wfx_pending_release(wdev, skb);
 		skb_queue_head(dropped, skb);
 	}
 }
 
-struct sk_buff *wfx_pending_get(struct wfx_dev *wdev, u32 packet_id)
+// Must be called with tx_pending.lock held
+static void __wfx_pending_refill(struct wfx_dev *wdev, struct sk_buff **slot,
+				 struct sk_buff *released)
 {
-	struct wfx_queue *queue;
-	struct hif_req_tx *req;
-	struct wfx_vif *wvif;
-	struct hif_msg *hif;
+	int idx = slot - wdev->tx_pending_slots;
 	struct sk_buff *skb;
 
-	spin_lock_bh(&wdev->tx_pending.lock);
 	skb_queue_walk(&wdev->tx_pending, skb) {
-		hif = (struct hif_msg *)skb->data;
-		req = (struct hif_req_tx *)hif->body;
-		if (req->packet_id != packet_id)
-			continue;
-		spin_unlock_bh(&wdev->tx_pending.lock);
-		wvif = wdev_to_wvif(wdev, hif->interface);
-		if (wvif) {
-			queue = &wvif->tx_queue[skb_get_queue_mapping(skb)];
-			WARN_ON(skb_get_queue_mapping(skb) > 3);
-			WARN_ON(!atomic_read(&queue->pending_frames));
-			atomic_dec(&queue->pending_frames);
+		if (skb != released &&
+		    wfx_pending_slot(wfx_skb_txreq(skb)->packet_id) == idx) {
+			*slot = skb;
+			wdev->tx_pending_unindexed--;
+			return;
 		}
-		skb_unlink(skb, &wdev->tx_pending);
-		return skb;
 	}
+}
+
+// Must be called with tx_pending.lock held
+static struct sk_buff *__wfx_pending_get(struct wfx_dev *wdev, u32 packet_id)
+{
+	struct sk_buff **slot;
+	struct sk_buff *skb;
+
+	slot = &wdev->tx_pending_slots[wfx_pending_slot(packet_id)];
+	skb = *slot;
+	if (skb && wfx_skb_txreq(skb)->packet_id == packet_id) {
+		*slot = NULL;
+		if (wdev->tx_pending_unindexed)
+			__wfx_pending_refill(wdev, slot, skb);
+	} else {
+		// Slot collision, fall back to the slow path
+		skb_queue_walk(&wdev->tx_pending, skb)
+			if (wfx_skb_txreq(skb)->packet_id == packet_id)
+				break;
+		if (skb == (struct sk_buff *)&wdev->tx_pending)
+			skb = NULL;
+		else
+			wdev->tx_pending_unindexed--;
+	}
+	if (skb)
+		__skb_unlink(skb, &wdev->tx_pending);
+	return skb;
+}
+
+// Fill skbs with the frames matching the confirmations. Unknown frames are
+// set to NULL.
+void wfx_pending_get_multi(struct wfx_dev *wdev, const struct hif_cnf_tx *cnf,
+			   struct sk_buff **skbs, int num)
+{
+	bool wake = false;
+	int i;
+
+	spin_lock_bh(&wdev->tx_pending.lock);
+	for (i = 0; i < num; i++)
+		skbs[i] = __wfx_pending_get(wdev, cnf[i].packet_id);
 	spin_unlock_bh(&wdev->tx_pending.lock);
-	WARN(1, "cannot find packet in pending queue");
-	return NULL;
+	for (i = 0; i < num; i++) {
+		if (WARN(!skbs[i], "cannot find packet in pending queue"))
+			continue;
+		if (__wfx_pending_release(wdev, skbs[i]))
+			wake = true;
+	}
+	// Wake up wfx_flush() and wfx_flush_sta()
+	if (wake)
+		wake_up(&wdev->tx_dequeue);
 }
 
 void wfx_pending_dump_old_frames(struct wfx_dev *wdev, unsigned int limit_ms)
@@ -223,58 +661,69 @@ bool wfx_tx_queues_has_cab(struct wfx_vif *wvif)
 
 	if (wvif->vif->type != NL80211_IFTYPE_AP)
 		return false;
-	for (i = 0; i < IEEE80211_NUM_ACS; ++i)
-		// Note: since only AP can have mcast frames in queue and only
-		// one vif can be AP, all queued frames has same interface id
-		if (!skb_queue_empty_lockless(&wvif->tx_queue[i].cab))
-			return true;
-	return false;
+	// Note: since only AP can have mcast frames in queue and only one vif
+	// can be AP, all queued frames has same interface id
+	return READ_ONCE(wvif->wdev->tx_cab_map) & wfx_tx_queues_mask(wvif);
 }
 
 static int wfx_tx_queue_get_weight(struct wfx_queue *queue)
 {
-	return atomic_read(&queue->pending_frames) * queue->priority;
+	return atomic_read(&queue->weight);
 }
 
+// Return the index of the lightest queue among the ones set in map
+static int wfx_tx_queues_elect(struct wfx_dev *wdev, unsigned long map)
+{
+	struct wfx_queue *queue, *best = NULL;
+	int bit, best_bit = -1;
+
+	// map has at most IEEE80211_NUM_ACS * ARRAY_SIZE(wdev->vif) bits
+	for_each_set_bit(bit, &map, BITS_PER_LONG) {
+		queue = wfx_tx_queue_from_bit(wdev, bit);
+		if (!queue)
+			continue;
+		if (!best || wfx_tx_queue_get_weight(queue) <
+			     wfx_tx_queue_get_weight(best)) {
+			best = queue;
+			best_bit = bit;
+		}
+	}
+	return best_bit;
+}
+
+/*
+ * A queue may have been emptied (eg. by wfx_tx_queue_drop()) since the maps
+ * were read. In this case, elect the next queue instead of giving up.
+ */
 static struct sk_buff *wfx_tx_queues_get_skb(struct wfx_dev *wdev)
 {
-	struct wfx_queue *queues[IEEE80211_NUM_ACS * ARRAY_SIZE(wdev->vif)];
-	int i, j, num_queues = 0;
+	unsigned long cab_map = READ_ONCE(wdev->tx_cab_map);
+	unsigned long map;
+	struct wfx_queue *queue;
 	struct wfx_vif *wvif;
 	struct hif_msg *hif;
 	struct sk_buff *skb;
-
-	// sort the queues
-	wvif = NULL;
-	while ((wvif = wvif_iterate(wdev, wvif)) != NULL) {
-		for (i = 0; i < IEEE80211_NUM_ACS; i++) {
-			WARN_ON(num_queues >= ARRAY_SIZE(queues));
-			queues[num_queues] = &wvif->tx_queue[i];
-			for (j = num_queues; j > 0; j--)
-				if (wfx_tx_queue_get_weight(queues[j]) <
-				    wfx_tx_queue_get_weight(queues[j - 1]))
-					swap(queues[j - 1], queues[j]);
-			num_queues++;
-		}
-	}
+	int bit;
 
 	wvif = NULL;
 	while ((wvif = wvif_iterate(wdev, wvif)) != NULL) {
 		if (!wvif->after_dtim_tx_allowed)
 			continue;
-		for (i = 0; i < num_queues; i++) {
-			skb = skb_dequeue(&queues[i]->cab);
-			if (!skb)
+		map = cab_map & wfx_tx_queues_mask(wvif);
+		while ((bit = wfx_tx_queues_elect(wdev, map)) >= 0) {
+			queue = &wvif->tx_queue[bit % IEEE80211_NUM_ACS];
+			skb = wfx_tx_queue_dequeue_cab(wvif, queue);
+			if (!skb) {
+				map &= ~BIT(bit);
 				continue;
+			}
 			// Note: since only AP can have mcast frames in queue
 			// and only one vif can be AP, all queued frames has
 			// same interface id
 			hif = (struct hif_msg *)skb->data;
 			WARN_ON(hif->interface != wvif->id);
-			WARN_ON(queues[i] !=
+			WARN_ON(queue !=
 				&wvif->tx_queue[skb_get_queue_mapping(skb)]);
-			atomic_inc(&queues[i]->pending_frames);
-			trace_queues_stats(wdev, queues[i]);
 			return skb;
 		}
 		// No more multicast to sent
@@ -282,30 +731,85 @@ static struct sk_buff *wfx_tx_queues_get_skb(struct wfx_dev *wdev)
 		schedule_work(&wvif->update_tim_work);
 	}
 
-	for (i = 0; i < num_queues; i++) {
-		skb = skb_dequeue(&queues[i]->normal);
-		if (skb) {
-			atomic_inc(&queues[i]->pending_frames);
-			trace_queues_stats(wdev, queues[i]);
+	map = READ_ONCE(wdev->tx_queues_map);
+	while ((bit = wfx_tx_queues_elect(wdev, map)) >= 0) {
+		wvif = wdev_to_wvif(wdev, bit / IEEE80211_NUM_ACS);
+		queue = &wvif->tx_queue[bit % IEEE80211_NUM_ACS];
+		skb = wfx_tx_queue_dequeue(wvif, queue);
+		if (skb)
 			return skb;
-		}
+		map &= ~BIT(bit);
 	}
 	return NULL;
 }
 
+/*
+ * Program the remaining lifetime of the frame in the request. The firmware
+ * counts it from the reception of the request (start_exp = 0) and it drops the
+ * frame (with status HIF_STATUS_TX_FAIL_TIMEOUT) once it is elapsed. Return
+ * false if the frame is already too old to be sent.
+ */
+static bool wfx_tx_queues_set_expire_time(struct sk_buff *skb)
+{
+	struct wfx_tx_priv *tx_priv = wfx_skb_tx_priv(skb);
+	struct hif_req_tx *req = wfx_skb_txreq(skb);
+	s32 remaining;
+
+	if (!tx_priv->deadline)
+		return true;
+	remaining = tx_priv->deadline - (u32)ktime_to_us(ktime_get());
+	if (remaining <= 0)
+		return false;
+	req->start_exp = 0;
+	// expire_time is in TU
+	req->expire_time = cpu_to_le32(DIV_ROUND_UP(remaining, 1024));
+	return true;
+}
+
 struct hif_msg *wfx_tx_queues_get(struct wfx_dev *wdev)
 {
 	struct wfx_tx_priv *tx_priv;
+	struct sk_buff_head expired;
+	struct wfx_queue *queue;
+	struct wfx_vif *wvif;
+	struct hif_msg *hif;
 	struct sk_buff *skb;
 
 	if (atomic_read(&wdev->tx_lock))
 		return NULL;
-	skb = wfx_tx_queues_get_skb(wdev);
-	if (!skb)
-		return NULL;
-	skb_queue_tail(&wdev->tx_pending, skb);
-	wake_up(&wdev->tx_dequeue);
-	tx_priv = wfx_skb_tx_priv(skb);
-	tx_priv->xmit_timestamp = ktime_get();
-	return (struct hif_msg *)skb->data;
+	skb_queue_head_init(&expired);
+	for (;;) {
+		skb = wfx_tx_queues_get_skb(wdev);
+		// Frames are pulled from mac80211 only when the device is able
+		// to receive them. Note that the pulled frame may be diverted
+		// to a CAB queue.
+		while (!skb && wfx_tx_pull(wdev)) {
+			// The pulled frame may need a new tx policy (see
+			// wfx_tx_get_rate_id()). Keep it queued until the
+			// policy is uploaded.
+			if (atomic_read(&wdev->tx_lock))
+				break;
+			skb = wfx_tx_queues_get_skb(wdev);
+		}
+		if (!skb || wfx_tx_queues_set_expire_time(skb))
+			break;
+		// Like the frames dropped from the queues, expired frames have
+		// never been pending in the firmware
+		__skb_queue_tail(&expired, skb);
+	}
+	if (skb) {
+		hif = (struct hif_msg *)skb->data;
+		wvif = wdev_to_wvif(wdev, hif->interface);
+		queue = &wvif->tx_queue[skb_get_queue_mapping(skb)];
+		wfx_tx_queue_inc_pending(queue, skb);
+		trace_queues_stats(wdev, queue);
+		tx_priv = wfx_skb_tx_priv(skb);
+		tx_priv->xmit_timestamp = ktime_get();
+		wfx_pending_put(wdev, skb);
+	}
+	// Wake up wfx_flush() and wfx_flush_sta()
+	if (skb || !skb_queue_empty(&expired))
+		wake_up(&wdev->tx_dequeue);
+	wfx_tx_report_expired(wdev, &expired);
+	return skb ? (struct hif_msg *)skb->data : NULL;
 }
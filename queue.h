@@ -10,14 +10,55 @@
 
 #include <linux/skbuff.h>
 #include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+
+#include "hif_api_cmd.h"
+
+// Must be a power of 2 lower than 65536 (see wfx_tx_inner())
+#define WFX_PENDING_SLOTS 256
+
+// One per link_id, including HIF_LINK_ID_NOT_ASSOCIATED
+#define WFX_LINK_SLOTS (HIF_LINK_ID_NOT_ASSOCIATED + 1)
+// Airtime (in us) granted to a link on each round of the scheduler
+#define WFX_AIRTIME_QUANTUM 300
+// Airtime (in us) charged for a frame before the link has any confirmation
+#define WFX_AIRTIME_DEFAULT 100
 
 struct wfx_dev;
 struct wfx_vif;
 
+// Limit the number of bytes of an AC queued in the driver and in the firmware
+struct wfx_tx_limit {
+	spinlock_t		lock;
+	int			inflight;
+	int			limit;
+	bool			stopped;
+	ktime_t			last_decrease;
+};
+
+struct wfx_link_queue {
+	struct sk_buff_head	skbs;
+	struct list_head	list; // Linked in wfx_queue->active if not empty
+	int			deficit; // in us
+	// Average airtime of the frames of the link (in us). Charged to
+	// deficit when a frame is dequeued.
+	unsigned int		airtime_avg;
+	atomic_t		pending_frames;
+};
+
 struct wfx_queue {
-	struct sk_buff_head	normal;
+	// Frames not yet sorted in links
+	struct llist_head	incoming;
+	// Protect links and active
+	spinlock_t		lock;
+	struct wfx_link_queue	links[WFX_LINK_SLOTS];
+	struct list_head	active;
 	struct sk_buff_head	cab; // Content After (DTIM) Beacon
 	atomic_t		pending_frames;
+	// pending_frames * priority
+	atomic_t		weight;
 	int			priority;
 };
 
@@ -26,6 +67,12 @@ void wfx_tx_unlock(struct wfx_dev *wdev);
 void wfx_tx_flush(struct wfx_dev *wdev);
 void wfx_tx_lock_flush(struct wfx_dev *wdev);
 
+void wfx_tx_limits_init(struct wfx_dev *wdev);
+void wfx_tx_limit_queued(struct wfx_dev *wdev, struct sk_buff *skb);
+void wfx_tx_limit_completed(struct wfx_dev *wdev, int ac, int len);
+void wfx_tx_limit_update(struct wfx_dev *wdev, int ac, unsigned int delay_us);
+void wfx_tx_limit_wake_queues(struct wfx_dev *wdev);
+
 void wfx_tx_queues_init(struct wfx_vif *wvif);
 void wfx_tx_queues_check_empty(struct wfx_vif *wvif);
 bool wfx_tx_queues_has_cab(struct wfx_vif *wvif);
@@ -33,10 +80,18 @@ void wfx_tx_queues_put(struct wfx_vif *wvif, struct sk_buff *skb);
 struct hif_msg *wfx_tx_queues_get(struct wfx_dev *wdev);
 
 bool wfx_tx_queue_empty(struct wfx_vif *wvif, struct wfx_queue *queue);
+bool wfx_tx_queues_flushed(struct wfx_vif *wvif, u32 mask);
+bool wfx_tx_link_flushed(struct wfx_vif *wvif, int link_id);
+void wfx_tx_link_drop(struct wfx_vif *wvif, int link_id,
+		      struct sk_buff_head *dropped);
+int wfx_tx_queue_len(const struct wfx_queue *queue);
+void wfx_tx_queue_charge_airtime(struct wfx_vif *wvif, struct sk_buff *skb,
+				 unsigned int airtime);
 void wfx_tx_queue_drop(struct wfx_vif *wvif, struct wfx_queue *queue,
 		       struct sk_buff_head *dropped);
 
-struct sk_buff *wfx_pending_get(struct wfx_dev *wdev, u32 packet_id);
+void wfx_pending_get_multi(struct wfx_dev *wdev, const struct hif_cnf_tx *cnf,
+			   struct sk_buff **skbs, int num);
 void wfx_pending_drop(struct wfx_dev *wdev, struct sk_buff_head *dropped);
 unsigned int wfx_pending_get_pkt_us_delay(struct wfx_dev *wdev,
 					  struct sk_buff *skb);
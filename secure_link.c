@@ -5,8 +5,13 @@
 
 #include <linux/of.h>
 #include <linux/module.h>
+#include <linux/version.h>
+#include <linux/scatterlist.h>
 #include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
 #include <crypto/sha.h>
+#include <crypto/aead.h>
 #include <mbedtls/md.h>
 #include <mbedtls/ecdh.h>
 #include <mbedtls/ccm.h>
@@ -28,6 +33,10 @@ static unsigned int slk_renew_period = BIT(29);
 module_param(slk_renew_period, int, 0644);
 MODULE_PARM_DESC(slk_renew_period, "number of secure link messages before renewing the key (default: 2^29).");
 
+static bool slk_kcrypto;
+module_param(slk_kcrypto, bool, 0444);
+MODULE_PARM_DESC(slk_kcrypto, "use kernel crypto API instead of mbedtls to encrypt secure link messages (default: false).");
+
 void mbedtls_platform_zeroize(void *buf, size_t len)
 {
 	memset(buf, 0, len);
@@ -45,12 +54,241 @@ int wfx_is_secure_command(struct wfx_dev *wdev, int cmd_id)
 	return test_bit(cmd_id, wdev->sl.commands);
 }
 
-int wfx_sl_decode(struct wfx_dev *wdev, struct hif_sl_msg *m)
+#if (KERNEL_VERSION(4, 14, 0) <= LINUX_VERSION_CODE)
+static struct aead_request *wfx_sl_kcrypto_alloc(void)
+{
+	struct aead_request *req;
+	struct crypto_aead *tfm;
+	int ret;
+
+	tfm = crypto_alloc_aead("ccm(aes)", 0, 0);
+	if (IS_ERR(tfm))
+		return ERR_CAST(tfm);
+	ret = crypto_aead_setauthsize(tfm, AES_CCM_TAG_SIZE);
+	if (ret)
+		goto err;
+	req = aead_request_alloc(tfm, GFP_KERNEL);
+	if (!req) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	return req;
+err:
+	crypto_free_aead(tfm);
+	return ERR_PTR(ret);
+}
+
+/*
+ * On encryption, tag is written after dst. On decryption, tag is read after
+ * src. Kernel crypto API does not support partially overlapping buffers, so
+ * decryption is done in place then moved to dst.
+ */
+static int wfx_sl_kcrypto(struct aead_request *req, u8 *iv, bool encrypt,
+			  const u32 *nonce, u8 *src, u8 *dst, size_t len)
+{
+	struct scatterlist sg_src, sg_dst;
+	DECLARE_CRYPTO_WAIT(wait);
+	int ret;
+
+	// CCM IV contains L - 1 (here, the nonce is 12 bytes long and L is 3),
+	// the nonce and the counter
+	memset(iv, 0, 16);
+	iv[0] = 2;
+	memcpy(iv + 1, nonce, 12);
+	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+				  CRYPTO_TFM_REQ_MAY_SLEEP,
+				  crypto_req_done, &wait);
+	aead_request_set_ad(req, 0);
+	if (encrypt) {
+		sg_init_one(&sg_src, src, len);
+		sg_init_one(&sg_dst, dst, len + AES_CCM_TAG_SIZE);
+		aead_request_set_crypt(req, &sg_src, &sg_dst, len, iv);
+		return crypto_wait_req(crypto_aead_encrypt(req), &wait);
+	}
+	sg_init_one(&sg_src, src, len + AES_CCM_TAG_SIZE);
+	aead_request_set_crypt(req, &sg_src, &sg_src, len + AES_CCM_TAG_SIZE,
+			       iv);
+	ret = crypto_wait_req(crypto_aead_decrypt(req), &wait);
+	if (!ret)
+		memmove(dst, src, len);
+	return ret;
+}
+#else
+static struct aead_request *wfx_sl_kcrypto_alloc(void)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+static int wfx_sl_kcrypto(struct aead_request *req, u8 *iv, bool encrypt,
+			  const u32 *nonce, u8 *src, u8 *dst, size_t len)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+static void wfx_sl_kcrypto_free(struct aead_request *req)
+{
+	struct crypto_aead *tfm = crypto_aead_reqtfm(req);
+
+	aead_request_free(req);
+	crypto_free_aead(tfm);
+}
+
+static int wfx_sl_kcrypto_init(struct wfx_dev *wdev)
+{
+	struct aead_request *req;
+
+	req = wfx_sl_kcrypto_alloc();
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+	wdev->sl.aead_req = req;
+	wdev->sl.aead = crypto_aead_reqtfm(req);
+	dev_info(wdev->dev, "secure link uses %s\n",
+		 crypto_tfm_alg_driver_name(crypto_aead_tfm(wdev->sl.aead)));
+	return 0;
+}
+
+static void wfx_sl_kcrypto_deinit(struct wfx_dev *wdev)
+{
+	if (!wdev->sl.aead)
+		return;
+	wfx_sl_kcrypto_free(wdev->sl.aead_req);
+	wdev->sl.aead_req = NULL;
+	wdev->sl.aead = NULL;
+}
+
+static int wfx_sl_setkey(struct wfx_dev *wdev, const u8 *key, size_t len)
+{
+	if (wdev->sl.aead)
+		return crypto_aead_setkey(wdev->sl.aead, key, len);
+	mbedtls_ccm_free(&wdev->sl.ccm_ctxt);
+	return mbedtls_ccm_setkey(&wdev->sl.ccm_ctxt, MBEDTLS_CIPHER_ID_AES,
+				  key, len * BITS_PER_BYTE);
+}
+
+// Tag is written after dst
+static int wfx_sl_encrypt(struct wfx_dev *wdev, const u32 *nonce,
+			  const u8 *src, u8 *dst, size_t len)
+{
+	int ret;
+
+	if (wdev->sl.aead) {
+		ret = wfx_sl_kcrypto(wdev->sl.aead_req, wdev->sl.aead_iv, true,
+				     nonce, (u8 *)src, dst, len);
+		if (ret)
+			dev_err(wdev->dev, "crypto error: %d\n", ret);
+		return ret;
+	}
+	ret = mbedtls_ccm_encrypt_and_tag(&wdev->sl.ccm_ctxt, len,
+			(u8 *)nonce, 12, NULL, 0, src, dst,
+			dst + len, sizeof(struct hif_sl_tag));
+	if (ret)
+		dev_err(wdev->dev, "mbedtls error: %08x\n", ret);
+	return ret;
+}
+
+// Tag is read after src
+static int wfx_sl_decrypt(struct wfx_dev *wdev, const u32 *nonce,
+			  u8 *src, u8 *dst, size_t len)
 {
 	int ret;
+
+	if (wdev->sl.aead) {
+		ret = wfx_sl_kcrypto(wdev->sl.aead_req, wdev->sl.aead_iv, false,
+				     nonce, src, dst, len);
+		if (ret)
+			dev_err(wdev->dev, "crypto error: %d\n", ret);
+		return ret;
+	}
+	ret = mbedtls_ccm_auth_decrypt(&wdev->sl.ccm_ctxt, len,
+			(u8 *)nonce, 12, NULL, 0, src, dst,
+			src + len, sizeof(struct hif_sl_tag));
+	if (ret)
+		dev_err(wdev->dev, "mbedtls error: %08x\n", ret);
+	return ret;
+}
+
+/*
+ * Measure the cost of one implementation of AES-CCM. Each of the num iterations
+ * encrypts then decrypts a message of len bytes (so it matches one message
+ * sent plus one message received). A random 16 bytes key is used, like the
+ * session keys. The context of the device is not used, so it works without
+ * secure link (eg. on the emulated bus).
+ */
+int wfx_sl_bench(bool kcrypto, size_t len, int num,
+		 s64 *duration_ns, u64 *duration_cycles)
+{
+	struct aead_request *req = NULL;
+	mbedtls_ccm_context ccm;
+	u32 nonce[3] = { };
+	cycles_t start_cycles;
+	u8 key[16], iv[16];
+	u8 *clear, *crypted;
+	ktime_t start;
+	int ret, i;
+
+	clear = kzalloc(2 * (len + AES_CCM_TAG_SIZE), GFP_KERNEL);
+	if (!clear)
+		return -ENOMEM;
+	crypted = clear + len + AES_CCM_TAG_SIZE;
+	get_random_bytes(key, sizeof(key));
+	mbedtls_ccm_init(&ccm);
+	if (kcrypto) {
+		req = wfx_sl_kcrypto_alloc();
+		if (IS_ERR(req)) {
+			ret = PTR_ERR(req);
+			req = NULL;
+			goto end;
+		}
+		ret = crypto_aead_setkey(crypto_aead_reqtfm(req), key,
+					 sizeof(key));
+	} else {
+		ret = mbedtls_ccm_setkey(&ccm, MBEDTLS_CIPHER_ID_AES, key,
+					 sizeof(key) * BITS_PER_BYTE);
+	}
+	if (ret)
+		goto end;
+
+	start = ktime_get();
+	start_cycles = get_cycles();
+	for (i = 0; i < num && !ret; i++) {
+		nonce[2] = i;
+		if (kcrypto) {
+			ret = wfx_sl_kcrypto(req, iv, true, nonce,
+					     clear, crypted, len);
+			if (!ret)
+				ret = wfx_sl_kcrypto(req, iv, false, nonce,
+						     crypted, clear, len);
+		} else {
+			ret = mbedtls_ccm_encrypt_and_tag(&ccm, len,
+					(u8 *)nonce, 12, NULL, 0, clear,
+					crypted, crypted + len,
+					AES_CCM_TAG_SIZE);
+			if (!ret)
+				ret = mbedtls_ccm_auth_decrypt(&ccm, len,
+					(u8 *)nonce, 12, NULL, 0, crypted,
+					clear, crypted + len,
+					AES_CCM_TAG_SIZE);
+		}
+	}
+	*duration_cycles = get_cycles() - start_cycles;
+	*duration_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+end:
+	// mbedtls does not return errno values
+	if (ret && !kcrypto)
+		ret = -EIO;
+	if (req)
+		wfx_sl_kcrypto_free(req);
+	mbedtls_ccm_free(&ccm);
+	kfree(clear);
+	return ret;
+}
+
+int wfx_sl_decode(struct wfx_dev *wdev, struct hif_sl_msg *m)
+{
 	size_t clear_len = le16_to_cpu(m->len);
 	size_t payload_len = round_up(clear_len - sizeof(m->len), 16);
-	u8 *tag = m->payload + payload_len;
 	u8 *output = (u8 *)m;
 	u32 nonce[3] = { };
 
@@ -66,46 +304,57 @@ int wfx_sl_decode(struct wfx_dev *wdev, struct hif_sl_msg *m)
 		schedule_work(&wdev->sl.key_renew_work);
 
 	memcpy(output, &m->len, sizeof(m->len));
-	ret = mbedtls_ccm_auth_decrypt(&wdev->sl.ccm_ctxt, payload_len,
-			(u8 *)nonce, sizeof(nonce), NULL, 0,
-			m->payload, output + sizeof(m->len),
-			tag, sizeof(struct hif_sl_tag));
-	if (ret) {
-		dev_err(wdev->dev, "mbedtls error: %08x\n", ret);
+	if (wfx_sl_decrypt(wdev, nonce, m->payload, output + sizeof(m->len),
+			   payload_len))
 		return -EIO;
-	}
 	if (memzcmp(output + clear_len, payload_len + sizeof(m->len) - clear_len))
 		dev_warn(wdev->dev, "padding is not 0\n");
 	return 0;
 }
 
-int wfx_sl_encode(struct wfx_dev *wdev,
-		  const struct hif_msg *input, struct hif_sl_msg *output)
+/*
+ * Return ERR_PTR(-EBUSY) if all the slots of the ring are in use. Caller may
+ * wait for the end of the pending bus transfers and retry.
+ */
+struct hif_sl_msg *wfx_sl_encode(struct wfx_dev *wdev,
+				 const struct hif_msg *input)
 {
+	struct sl_context *sl = &wdev->sl;
 	int payload_len =
 		round_up(le16_to_cpu(input->len) - sizeof(input->len), 16);
-	u8 *tag = output->payload + payload_len;
+	struct hif_sl_msg *output;
 	u32 nonce[3] = { };
-	int ret;
+
+	if (atomic_read(&sl->tx_used) >= sl->tx_slots)
+		return ERR_PTR(-EBUSY);
+	output = (struct hif_sl_msg *)(sl->tx_ring +
+				       sl->tx_head * sl->tx_slot_size);
 
 	output->hdr.encrypted = 0x1;
 	output->len = input->len;
-	output->hdr.seqnum = wdev->sl.tx_seqnum;
+	output->hdr.seqnum = sl->tx_seqnum;
 	// Other bytes of nonce are 0
-	nonce[2] = wdev->sl.tx_seqnum;
-	wdev->sl.tx_seqnum++;
-	if (wdev->sl.tx_seqnum == slk_renew_period)
-		schedule_work(&wdev->sl.key_renew_work);
+	nonce[2] = sl->tx_seqnum;
+
+	if (wfx_sl_encrypt(wdev, nonce, (u8 *)input + sizeof(input->len),
+			   output->payload, payload_len))
+		return ERR_PTR(-EIO);
+	sl->tx_seqnum++;
+	if (sl->tx_seqnum == slk_renew_period)
+		schedule_work(&sl->key_renew_work);
+	sl->tx_head = (sl->tx_head + 1) % sl->tx_slots;
+	atomic_inc(&sl->tx_used);
+	return output;
+}
 
-	ret = mbedtls_ccm_encrypt_and_tag(&wdev->sl.ccm_ctxt, payload_len,
-			(u8 *)nonce, sizeof(nonce), NULL, 0,
-			(u8 *)input + sizeof(input->len), output->payload,
-			tag, sizeof(struct hif_sl_tag));
-	if (ret) {
-		dev_err(wdev->dev, "mbedtls error: %08x\n", ret);
-		return -EIO;
-	}
-	return 0;
+/*
+ * Release the num oldest slots of the ring. May be called from the completion
+ * handler of the bus.
+ */
+void wfx_sl_tx_release(struct wfx_dev *wdev, int num)
+{
+	if (num)
+		WARN_ON(atomic_sub_return(num, &wdev->sl.tx_used) < 0);
 }
 
 static int wfx_sl_get_pubkey_mac(struct wfx_dev *wdev,
@@ -159,12 +408,11 @@ int wfx_sl_check_pubkey(struct wfx_dev *wdev,
 
 	wdev->sl.rx_seqnum = 0;
 	wdev->sl.tx_seqnum = 0;
-	mbedtls_ccm_free(&wdev->sl.ccm_ctxt);
 	// Use the lower 16 bytes of the sha256 of the secret for AES key
-	ret = mbedtls_ccm_setkey(&wdev->sl.ccm_ctxt, MBEDTLS_CIPHER_ID_AES,
-			secret_digest, 16 * BITS_PER_BYTE);
+	ret = wfx_sl_setkey(wdev, secret_digest, 16);
 
 end:
+	wdev->sl.key_valid = !ret;
 	complete(&wdev->sl.key_renew_done);
 	return 0;
 }
@@ -197,7 +445,7 @@ static int wfx_sl_key_exchange(struct wfx_dev *wdev)
 		wfx_bh_poll_irq(wdev);
 	if (!wait_for_completion_timeout(&wdev->sl.key_renew_done, msecs_to_jiffies(500)))
 		goto err;
-	if (!memzcmp(&wdev->sl.ccm_ctxt, sizeof(wdev->sl.ccm_ctxt)))
+	if (!wdev->sl.key_valid)
 		goto err;
 
 	mbedtls_ecdh_free(&wdev->sl.edch_ctxt);
@@ -241,6 +489,28 @@ static void wfx_sl_init_cfg(struct wfx_dev *wdev)
 	bitmap_copy(wdev->sl.commands, sl_commands, 256);
 }
 
+/*
+ * The ring is sized to hold as many messages as the chip can buffer. A slot is
+ * big enough for the largest encrypted message plus the padding added by the
+ * bus. Slots are aligned on cache lines so they can be used for DMA.
+ */
+static int wfx_sl_alloc_tx_ring(struct wfx_dev *wdev)
+{
+	size_t len = wdev->hw_caps.size_inp_ch_buf + 16 +
+		     sizeof(struct hif_sl_msg_hdr) + sizeof(struct hif_sl_tag);
+
+	len = wdev->hwbus_ops->align_size(wdev->hwbus_priv, len);
+	wdev->sl.tx_slot_size = round_up(len, L1_CACHE_BYTES);
+	wdev->sl.tx_slots = max_t(int, wdev->hw_caps.num_inp_ch_bufs, 1);
+	wdev->sl.tx_head = 0;
+	atomic_set(&wdev->sl.tx_used, 0);
+	wdev->sl.tx_ring = kmalloc_array(wdev->sl.tx_slots,
+					 wdev->sl.tx_slot_size, GFP_KERNEL);
+	if (!wdev->sl.tx_ring)
+		return -ENOMEM;
+	return 0;
+}
+
 int wfx_sl_init(struct wfx_dev *wdev)
 {
 	INIT_WORK(&wdev->sl.key_renew_work, wfx_sl_renew_key);
@@ -251,6 +521,13 @@ int wfx_sl_init(struct wfx_dev *wdev)
 		dev_info(wdev->dev, "this driver only support secure link API >= 2.0\n");
 		return -EIO;
 	}
+	if (wdev->hw_caps.link_mode == SEC_LINK_ENFORCED ||
+	    wdev->hw_caps.link_mode == SEC_LINK_EVAL) {
+		if (wfx_sl_alloc_tx_ring(wdev))
+			return -ENOMEM;
+		if (slk_kcrypto && wfx_sl_kcrypto_init(wdev))
+			dev_warn(wdev->dev, "cannot use kernel crypto API, fall back to mbedtls\n");
+	}
 	if (wdev->hw_caps.link_mode == SEC_LINK_ENFORCED) {
 		bitmap_set(wdev->sl.commands, HIF_REQ_ID_SL_CONFIGURE, 1);
 		if (wfx_sl_key_exchange(wdev))
@@ -271,6 +548,9 @@ int wfx_sl_init(struct wfx_dev *wdev)
 void wfx_sl_deinit(struct wfx_dev *wdev)
 {
 	mbedtls_ccm_free(&wdev->sl.ccm_ctxt);
+	wfx_sl_kcrypto_deinit(wdev);
+	kfree(wdev->sl.tx_ring);
+	wdev->sl.tx_ring = NULL;
 }
 
 void wfx_sl_fill_pdata(struct device *dev, struct wfx_platform_data *pdata)
@@ -12,6 +12,8 @@ struct wfx_dev;
 #ifdef CONFIG_WFX_SECURE_LINK
 
 #include <linux/bitmap.h>
+#include <linux/atomic.h>
+#include <crypto/aead.h>
 #include <mbedtls/ecdh.h>
 #include <mbedtls/ccm.h>
 
@@ -25,12 +27,28 @@ struct sl_context {
 	DECLARE_BITMAP(commands, 256);
 	mbedtls_ecdh_context edch_ctxt; // Only valid druing key negociation
 	mbedtls_ccm_context  ccm_ctxt;
+	// If not NULL, kernel crypto API is used instead of ccm_ctxt. Only
+	// accessed from bh.
+	struct crypto_aead   *aead;
+	struct aead_request  *aead_req;
+	u8                   aead_iv[16];
+	bool                 key_valid;
+	// Encrypted messages are written in this ring. Bus transfers complete
+	// in order, so the slots are released in the order they were taken.
+	u8                   *tx_ring;
+	size_t               tx_slot_size;
+	int                  tx_slots;
+	int                  tx_head; // Only accessed from bh
+	atomic_t             tx_used;
 };
 
 int wfx_is_secure_command(struct wfx_dev *wdev, int cmd_id);
 int wfx_sl_decode(struct wfx_dev *wdev, struct hif_sl_msg *m);
-int wfx_sl_encode(struct wfx_dev *wdev,
-		  const struct hif_msg *input, struct hif_sl_msg *output);
+struct hif_sl_msg *wfx_sl_encode(struct wfx_dev *wdev,
+				 const struct hif_msg *input);
+void wfx_sl_tx_release(struct wfx_dev *wdev, int num);
+int wfx_sl_bench(bool kcrypto, size_t len, int num,
+		 s64 *duration_ns, u64 *duration_cycles);
 int wfx_sl_check_pubkey(struct wfx_dev *wdev,
 			const u8 *ncp_pubkey, const u8 *ncp_pubmac);
 int wfx_sl_init(struct wfx_dev *wdev);
@@ -40,6 +58,7 @@ void wfx_sl_fill_pdata(struct device *dev, struct wfx_platform_data *pdata);
 #else /* CONFIG_WFX_SECURE_LINK */
 
 #include <linux/of.h>
+#include <linux/err.h>
 
 struct sl_context {
 };
@@ -54,11 +73,14 @@ static inline int wfx_sl_decode(struct wfx_dev *wdev, struct hif_sl_msg *m)
 	return -EIO;
 }
 
-static inline int wfx_sl_encode(struct wfx_dev *wdev,
-				const struct hif_msg *input,
-				struct hif_sl_msg *output)
+static inline struct hif_sl_msg *wfx_sl_encode(struct wfx_dev *wdev,
+					       const struct hif_msg *input)
+{
+	return ERR_PTR(-EIO);
+}
+
+static inline void wfx_sl_tx_release(struct wfx_dev *wdev, int num)
 {
-	return -EIO;
 }
 
 static inline int wfx_sl_check_pubkey(struct wfx_dev *wdev,
@@ -341,14 +341,15 @@ DEFINE_EVENT(piggyback, piggyback,
 #define _trace_piggyback(val, ignored) trace_piggyback(val, ignored)
 
 TRACE_EVENT(bh_stats,
-	TP_PROTO(int ind, int req, int cnf, int busy, bool release),
-	TP_ARGS(ind, req, cnf, busy, release),
+	TP_PROTO(int ind, int req, int cnf, int busy, bool release, int batch),
+	TP_ARGS(ind, req, cnf, busy, release, batch),
 	TP_STRUCT__entry(
 		__field(int, ind)
 		__field(int, req)
 		__field(int, cnf)
 		__field(int, busy)
 		__field(bool, release)
+		__field(int, batch)
 	),
 	TP_fast_assign(
 		__entry->ind = ind;
@@ -356,17 +357,19 @@ TRACE_EVENT(bh_stats,
 		__entry->cnf = cnf;
 		__entry->busy = busy;
 		__entry->release = release;
+		__entry->batch = batch;
 	),
-	TP_printk("IND/REQ/CNF:%3d/%3d/%3d, REQ in progress:%3d, WUP: %s",
+	TP_printk("IND/REQ/CNF:%3d/%3d/%3d, REQ in progress:%3d, WUP: %s, TX batch:%3d",
 		__entry->ind,
 		__entry->req,
 		__entry->cnf,
 		__entry->busy,
-		__entry->release ? "release" : "keep"
+		__entry->release ? "release" : "keep",
+		__entry->batch
 	)
 );
-#define _trace_bh_stats(ind, req, cnf, busy, release)\
-	trace_bh_stats(ind, req, cnf, busy, release)
+#define _trace_bh_stats(ind, req, cnf, busy, release, batch)\
+	trace_bh_stats(ind, req, cnf, busy, release, batch)
 
 TRACE_EVENT(tx_stats,
 	TP_PROTO(const struct hif_cnf_tx *tx_cnf, const struct sk_buff *skb,
@@ -473,7 +476,7 @@ TRACE_EVENT(queues_stats,
 				WARN_ON(j >= IEEE80211_NUM_ACS * 2);
 				queue = &wvif->tx_queue[i];
 				__entry->hw[j] = atomic_read(&queue->pending_frames);
-				__entry->drv[j] = skb_queue_len(&queue->normal);
+				__entry->drv[j] = wfx_tx_queue_len(queue);
 				__entry->cab[j] = skb_queue_len(&queue->cab);
 				if (queue == elected_queue) {
 					__entry->vif_id = wvif->id;
@@ -81,6 +81,12 @@ struct wfx_dev {
 	struct mac_address	addresses[2];
 	const struct hwbus_ops	*hwbus_ops;
 	void			*hwbus_priv;
+	// DMA-safe buffers for register accesses. Protected by the bus lock.
+	__le32			*io_reg_buf;
+	__le32			*io_ind_buf;
+	// Error bits seen in the config register and not yet cleared (see
+	// config_reg_track_errors()). Protected by the bus lock.
+	u32			config_reg_errors;
 
 	u8			keyset;
 	struct completion	firmware_ready;
@@ -94,7 +100,25 @@ struct wfx_dev {
 
 	struct wfx_hif_cmd	hif_cmd;
 	struct sk_buff_head	tx_pending;
+	// Index of tx_pending by packet_id. Protected by tx_pending.lock
+	struct sk_buff		*tx_pending_slots[WFX_PENDING_SLOTS];
+	// Number of frames of tx_pending not indexed because of a slot
+	// collision. Protected by tx_pending.lock
+	int			tx_pending_unindexed;
+	// Frames waiting to be reported to mac80211. Only bh reports them.
+	struct sk_buff_head	tx_status;
 	wait_queue_head_t	tx_dequeue;
+	// Bit (vif_id * IEEE80211_NUM_ACS + ac) is set if the matching queue is
+	// not empty. Protected by wfx_queue->lock and wfx_queue->cab.lock.
+	unsigned long		tx_queues_map;
+	unsigned long		tx_cab_map;
+	struct wfx_tx_limit	tx_limit[IEEE80211_NUM_ACS];
+	// Bit vif_id is set while the tx policy cache of the vif is full
+	unsigned long		tx_policy_full;
+	// Maximum lifetime of the frames of each AC in ms (0 means no limit)
+	u32			tx_lifetime[IEEE80211_NUM_ACS];
+	atomic_t		tx_expired_drv[IEEE80211_NUM_ACS];
+	atomic_t		tx_expired_fw[IEEE80211_NUM_ACS];
 	atomic_t		tx_lock;
 
 	atomic_t		packet_id;